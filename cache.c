@@ -1,19 +1,36 @@
 
 /* Thread-safe cache implementation using LinkedList.
  * *************************************************
- * This cache implementation uses a linkedlist by locking at two levels.
- * There is a cache level lock, which is used when a thread wants to
- * read/update the head of the linkedlist of the cache.
+ * Readers take no locks. A reader enters a read section by publishing the
+ * current epoch in a slot of its own, looks the entry up and uses it until
+ * it leaves the section. Writers (insert, evict, reload) are serialized by
+ * the cache lock. They never change a published entry in place: a removed
+ * entry is retired with the epoch it was removed in, and freed, with its
+ * delete callback run, once every reader in a section entered after that.
+ * For a module that means dlclose is deferred until no request can still
+ * be running its code.
  *
- * If a thread wants to just access an element inside the cache, it should
- * acquire the read writer lock of that element.
+ * Eviction approximates LRU with the CLOCK algorithm. A hit only sets the
+ * entry's reference bit, which needs neither the entry's write lock nor the
+ * time. The clock hand sweeps the list from where it last stopped, giving
+ * referenced entries a second chance by clearing their bit, and evicts the
+ * first entry which was not referenced since the hand last passed it.
+ * New entries go right behind the hand, so they are the last to be looked
+ * at.
  *
- * Cache is implemented using LRU with unix timestamps. When a thread accesses
- * a data item, the timestamp is updated to the latest timestamp and when
- * eviction is done, the oldest entry is evicted.
+ * Recency alone lets a single pass over rarely used modules flush the hot
+ * ones, each eviction costing a dlclose and the next hit on it a dlopen.
+ * The W-TinyLFU policy guards against that. Lookups are counted in a
+ * count-min sketch whose counters are halved every CACHE_SKETCH_SAMPLES
+ * increments, so it tells how often a key was asked for lately. New
+ * entries go to a small window region with a clock of its own. An entry
+ * which the window's clock pushes out moves to the main region if there is
+ * room; otherwise it takes the place of the main clock's victim only if it
+ * was used more often, and is evicted instead if not.
  *
- * This is an approximation of LRU and is not a strict LRU as there will be
- * scenarios in which multiple threads access the entry at the same time.
+ * Lookups don't walk the list. The entries are also indexed by an open
+ * addressing hash table keyed by the precomputed hash of their key, so a
+ * lookup usually reads one slot and compares one key.
  *
  * Author: Vamshi Reddy Konagari (vkonagar@andrew.cmu.edu)
  * Date: 12/4/2016
@@ -24,27 +41,441 @@
 #include <stdio.h>
 #include <unistd.h>
 #include "csapp.h"
+#include "job_queue.h"
+
+/* Reader slots, shared by all caches. A thread takes a slot the first time
+ * it reads and gives it back when it exits. Every slot has cache lines of
+ * its own, so entering and leaving a section or counting a lookup writes
+ * no shared line. The counts stay with the slot when it is given back, so
+ * their sums never go down */
+typedef struct cache_reader
+{
+    _Alignas(CACHE_LINE_SIZE) atomic_ulong epoch; /* 0 outside a section */
+    atomic_int in_use;
+    atomic_long hits[CACHE_COUNTED_CACHES]; /* Written by the owner only */
+    atomic_long misses[CACHE_COUNTED_CACHES];
+}cache_reader_t;
+
+static cache_reader_t readers[CACHE_MAX_READERS];
+static atomic_int reader_slots_used; /* Bounds the scan of the slots */
+static atomic_ulong global_epoch = 1;
+static atomic_int counted_caches; /* Caches given counters in the slots */
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local cache_reader_t* thread_reader;
+
+/* Multipliers giving every row of the sketch its own hash of the key */
+static const uint64_t sketch_seeds[CACHE_SKETCH_DEPTH] = {
+    0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+    0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL
+};
 
 void display_cache(cache_t* cache)
 {
-    cache_entry_t* temp = cache->head;
+    cache_entry_t* temp = cache_first_entry(cache);
     printf("--------START-----\n");
     while(temp)
     {
         printf("%s:%p\n", temp->data->key.key_data, temp->data->value.value_data);
-        temp = temp->next;
+        temp = cache_next_entry(cache, temp);
     }
     printf("--------END------\n");
 }
 
+const char* cache_policy_name(int policy)
+{
+    return policy == CACHE_POLICY_TINYLFU ? "W-TinyLFU" : "CLOCK";
+}
+
+static size_t sketch_slot(uint64_t hash, int row)
+{
+    return (hash * sketch_seeds[row]) >> (64 - CACHE_SKETCH_BITS);
+}
+
+/* Ages the sketch, so that keys which were popular long ago don't keep
+ * their counts */
+static void sketch_halve(cache_sketch_t* sketch)
+{
+    int row, i;
+    for (row = 0; row < CACHE_SKETCH_DEPTH; row++)
+    {
+        for (i = 0; i < CACHE_SKETCH_WIDTH; i++)
+        {
+            atomic_uchar* counter = &sketch->count[row][i];
+            atomic_store_explicit(counter, atomic_load_explicit(counter,
+                                        memory_order_relaxed) / 2,
+                                  memory_order_relaxed);
+        }
+    }
+    atomic_fetch_sub_explicit(&sketch->samples, CACHE_SKETCH_SAMPLES / 2,
+                              memory_order_relaxed);
+}
+
+/* Counts a lookup of the key. Saturated counters are not written, so the
+ * lookups of a hot key mostly just read the sketch */
+static void sketch_increment(cache_sketch_t* sketch, uint64_t hash)
+{
+    int row;
+    int added = 0;
+    for (row = 0; row < CACHE_SKETCH_DEPTH; row++)
+    {
+        atomic_uchar* counter = &sketch->count[row][sketch_slot(hash, row)];
+        unsigned char count = atomic_load_explicit(counter,
+                                                   memory_order_relaxed);
+        if (count < CACHE_SKETCH_MAX_COUNT)
+        {
+            atomic_store_explicit(counter, count + 1, memory_order_relaxed);
+            added = 1;
+        }
+    }
+    if (added && atomic_fetch_add_explicit(&sketch->samples, 1,
+                        memory_order_relaxed) + 1 == CACHE_SKETCH_SAMPLES)
+        sketch_halve(sketch);
+}
+
+/* @return estimate of the lookups of the key. Never too low, unless an
+ * increment was lost */
+static int sketch_frequency(cache_sketch_t* sketch, uint64_t hash)
+{
+    int row;
+    int frequency = CACHE_SKETCH_MAX_COUNT;
+    for (row = 0; row < CACHE_SKETCH_DEPTH; row++)
+    {
+        int count = atomic_load_explicit(
+                        &sketch->count[row][sketch_slot(hash, row)],
+                        memory_order_relaxed);
+        if (count < frequency)
+            frequency = count;
+    }
+    return frequency;
+}
+
+/* 64 bit FNV-1a */
+static uint64_t hash_key_data(const char* data, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void init_cache_key(cache_key_t* key, char* data)
+{
+    key->key_data = data;
+    key->length = strlen(data);
+    key->hash = hash_key_data(data, key->length);
+}
+
+void copy_cache_key(cache_key_t* dst, cache_key_t* src)
+{
+    dst->key_data = (char*)Malloc(src->length + 1);
+    memcpy(dst->key_data, src->key_data, src->length + 1);
+    dst->length = src->length;
+    dst->hash = src->hash;
+}
+
+static int cache_key_equal(cache_key_t* a, cache_key_t* b)
+{
+    return a->hash == b->hash && a->length == b->length &&
+           memcmp(a->key_data, b->key_data, a->length) == 0;
+}
+
+/* Puts the entry in the first free slot from its home slot. The index must
+ * have a free slot. The entry is stored last, so a reader which sees it
+ * sees its hash too */
+static void index_place(cache_index_t* index, uint64_t hash,
+                        cache_entry_t* entry)
+{
+    size_t mask = index->slots - 1;
+    size_t i = hash & mask;
+    while (atomic_load_explicit(&index->slot[i].entry,
+                                memory_order_relaxed) != NULL)
+        i = (i + 1) & mask;
+    atomic_store_explicit(&index->slot[i].hash, hash, memory_order_relaxed);
+    atomic_store_explicit(&index->slot[i].entry, entry, memory_order_release);
+}
+
+static cache_index_t* new_cache_index(size_t slots)
+{
+    cache_index_t* index = (cache_index_t*)Calloc(1, sizeof(cache_index_t) +
+                                        slots * sizeof(cache_index_slot_t));
+    index->slots = slots;
+    return index;
+}
+
+static void release_reader(void* arg)
+{
+    cache_reader_t* reader = (cache_reader_t*)arg;
+    atomic_store(&reader->epoch, 0);
+    atomic_store(&reader->in_use, 0);
+}
+
+static void create_reader_key()
+{
+    if (pthread_key_create(&reader_key, release_reader) != 0)
+    {
+        perror("Cannot create the cache reader key");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* @return the reader slot of the calling thread */
+static cache_reader_t* get_reader()
+{
+    if (thread_reader != NULL)
+        return thread_reader;
+    Pthread_once(&reader_key_once, create_reader_key);
+    int i;
+    for (i = 0; i < CACHE_MAX_READERS; i++)
+    {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&readers[i].in_use, &expected, 1))
+            break;
+    }
+    if (i == CACHE_MAX_READERS)
+    {
+        printf("Too many cache readers\n");
+        exit(EXIT_FAILURE);
+    }
+    int used = atomic_load(&reader_slots_used);
+    while (used < i + 1 &&
+           !atomic_compare_exchange_weak(&reader_slots_used, &used, i + 1));
+    thread_reader = &readers[i];
+    pthread_setspecific(reader_key, thread_reader);
+    return thread_reader;
+}
+
+void cache_read_begin()
+{
+    cache_reader_t* reader = get_reader();
+    atomic_store_explicit(&reader->epoch, atomic_load(&global_epoch),
+                          memory_order_relaxed);
+    /* The lookups that follow must not be done before writers can see the
+     * epoch, or a writer could free what they find */
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void cache_read_end()
+{
+    atomic_store_explicit(&thread_reader->epoch, 0, memory_order_release);
+}
+
+/* @return the oldest epoch a reader may still be in */
+static unsigned long oldest_reader_epoch()
+{
+    unsigned long oldest = atomic_load(&global_epoch);
+    int used = atomic_load(&reader_slots_used);
+    int i;
+    for (i = 0; i < used; i++)
+    {
+        unsigned long epoch = atomic_load(&readers[i].epoch);
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+    return oldest;
+}
+
+/* Shard holding the keys with this hash. The index uses the low bits of
+ * the hash, so the shard is picked with higher ones */
+static cache_shard_t* shard_of(cache_t* cache, uint64_t hash)
+{
+    return &cache->shard[(hash >> 32) & (cache->shard_count - 1)];
+}
+
+/* Queues an object which readers can no longer find, and moves to the next
+ * epoch. Readers which enter from now on can't see it.
+ * ASSUMPTION: shard write lock is held */
+static void retire(cache_shard_t* shard, void* object, void (*reclaim)(void*))
+{
+    cache_retired_t* retired = (cache_retired_t*)Malloc(
+                                                    sizeof(cache_retired_t));
+    retired->object = object;
+    retired->reclaim = reclaim;
+    retired->epoch = atomic_fetch_add(&global_epoch, 1);
+    retired->next = shard->retired;
+    shard->retired = retired;
+}
+
+/* Frees the retired objects no reader can still hold.
+ * ASSUMPTION: shard write lock is held */
+static void reclaim_retired(cache_shard_t* shard)
+{
+    if (shard->retired == NULL)
+        return;
+    unsigned long oldest = oldest_reader_epoch();
+    cache_retired_t** link = &shard->retired;
+    while (*link)
+    {
+        cache_retired_t* retired = *link;
+        if (retired->epoch < oldest)
+        {
+            *link = retired->next;
+            retired->reclaim(retired->object);
+            Free(retired);
+        }
+        else
+        {
+            link = &retired->next;
+        }
+    }
+}
+
+void reclaim_cache(cache_t* cache)
+{
+    int i;
+    for (i = 0; i < cache->shard_count; i++)
+    {
+        cache_shard_t* shard = &cache->shard[i];
+        Pthread_rwlock_wrlock(&shard->lock);
+        reclaim_retired(shard);
+        Pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+void synchronize_cache(cache_t* cache)
+{
+    /* Everything removed so far was retired before this epoch */
+    unsigned long target = atomic_load(&global_epoch);
+    while (oldest_reader_epoch() < target)
+        usleep(CACHE_GRACE_POLL_US);
+    reclaim_cache(cache);
+}
+
+static void reclaim_entry(void* object)
+{
+    cache_entry_t* entry = (cache_entry_t*)object;
+    /* Call back is called to perform clean up */
+    if (entry->delete_callback != NULL)
+        entry->delete_callback(entry->data);
+    free_cache_entry(entry);
+}
+
+/* Doubles the index and rehashes the entries. Hashes are stored, so no key
+ * is read. Readers may still be probing the old index, so it is retired
+ * ASSUMPTION: cache write lock is held */
+static void index_grow(cache_shard_t* shard)
+{
+    cache_index_t* old = atomic_load_explicit(&shard->index,
+                                              memory_order_relaxed);
+    cache_index_t* index = new_cache_index(old->slots * 2);
+    size_t i;
+    for (i = 0; i < old->slots; i++)
+    {
+        cache_entry_t* entry = atomic_load_explicit(&old->slot[i].entry,
+                                                    memory_order_relaxed);
+        if (entry != NULL)
+            index_place(index, atomic_load_explicit(&old->slot[i].hash,
+                                    memory_order_relaxed), entry);
+    }
+    atomic_store(&shard->index, index);
+    retire(shard, old, free);
+}
+
+/* ASSUMPTION: cache write lock is held */
+static void index_insert(cache_shard_t* shard, cache_entry_t* entry)
+{
+    cache_index_t* index = atomic_load_explicit(&shard->index,
+                                                memory_order_relaxed);
+    if ((shard->index_count + 1) * 2 > index->slots)
+    {
+        index_grow(shard);
+        index = atomic_load_explicit(&shard->index, memory_order_relaxed);
+    }
+    index_place(index, entry->data->key.hash, entry);
+    shard->index_count++;
+}
+
+/* Removes the entry and shifts back the entries probed past its slot, so
+ * the index needs no tombstones. A reader probing meanwhile may miss an
+ * entry being shifted. Misses are checked again under the writer lock, so
+ * that only costs the reader a trip to the slow path.
+ * ASSUMPTION: cache write lock is held */
+static void index_remove(cache_shard_t* shard, cache_entry_t* entry)
+{
+    cache_index_t* index = atomic_load_explicit(&shard->index,
+                                                memory_order_relaxed);
+    cache_index_slot_t* slot = index->slot;
+    size_t mask = index->slots - 1;
+    size_t i = entry->data->key.hash & mask;
+    cache_entry_t* current;
+    while ((current = atomic_load_explicit(&slot[i].entry,
+                                           memory_order_relaxed)) != entry)
+    {
+        if (current == NULL)
+            return; /* Not indexed */
+        i = (i + 1) & mask;
+    }
+    size_t j = i;
+    while (1)
+    {
+        j = (j + 1) & mask;
+        cache_entry_t* moved = atomic_load_explicit(&slot[j].entry,
+                                                    memory_order_relaxed);
+        if (moved == NULL)
+            break;
+        /* An entry can move into the hole only if its home slot is not
+         * between the hole and where it sits now */
+        uint64_t hash = atomic_load_explicit(&slot[j].hash,
+                                             memory_order_relaxed);
+        size_t home = hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            atomic_store_explicit(&slot[i].hash, hash, memory_order_relaxed);
+            atomic_store_explicit(&slot[i].entry, moved,
+                                  memory_order_release);
+            i = j;
+        }
+    }
+    atomic_store_explicit(&slot[i].entry, NULL, memory_order_release);
+    shard->index_count--;
+}
+
+static cache_entry_t* index_lookup(cache_index_t* index, cache_key_t* key)
+{
+    size_t mask = index->slots - 1;
+    size_t i = key->hash & mask;
+    cache_entry_t* entry;
+    while ((entry = atomic_load_explicit(&index->slot[i].entry,
+                                         memory_order_acquire)) != NULL)
+    {
+        /* The entry's own key decides, the slot may be changing under us */
+        if (atomic_load_explicit(&index->slot[i].hash,
+                                 memory_order_relaxed) == key->hash &&
+            cache_key_equal(&entry->data->key, key))
+            return entry;
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/* Writers changing a key only lock its shard */
+void get_cache_shard_wrlock(cache_t* cache, cache_key_t* key)
+{
+    Pthread_rwlock_wrlock(&shard_of(cache, key->hash)->lock);
+}
+
+void release_cache_shard_wrlock(cache_t* cache, cache_key_t* key)
+{
+    Pthread_rwlock_unlock(&shard_of(cache, key->hash)->lock);
+}
+
+/* Locks all of the shards, always in the same order */
 void get_global_cache_wrlock(cache_t* cache)
 {
-    Pthread_rwlock_wrlock(&cache->lock);
+    int i;
+    for (i = 0; i < cache->shard_count; i++)
+        Pthread_rwlock_wrlock(&cache->shard[i].lock);
 }
 
 void release_global_cache_wrlock(cache_t* cache)
 {
-    Pthread_rwlock_unlock(&cache->lock);
+    int i;
+    for (i = cache->shard_count - 1; i >= 0; i--)
+        Pthread_rwlock_unlock(&cache->shard[i].lock);
 }
 
 /* get_new_cache_entry
@@ -58,216 +489,431 @@ cache_entry_t* get_new_cache_entry()
     entry->prev = NULL;
     entry->next = NULL;
     entry->data_size = 0;
-    /* Initialize the lock */
-    if (pthread_rwlock_init(&entry->lock, NULL) != 0)
+    entry->delete_callback = NULL;
+    entry->region = NULL;
+    atomic_init(&entry->referenced, 0);
+    return entry;
+}
+
+
+static void init_cache_shard(cache_shard_t* shard, int policy, int capacity)
+{
+    shard->policy = policy;
+    shard->capacity = capacity;
+    shard->total_size = 0;
+    memset(&shard->window, 0, sizeof(cache_region_t));
+    memset(&shard->main, 0, sizeof(cache_region_t));
+    shard->retired = NULL;
+    shard->index_count = 0;
+    shard->sketch = NULL;
+    if (policy == CACHE_POLICY_TINYLFU)
+        shard->sketch = (cache_sketch_t*)Calloc(1, sizeof(cache_sketch_t));
+    atomic_init(&shard->hits, 0);
+    atomic_init(&shard->misses, 0);
+    atomic_init(&shard->evictions, 0);
+    atomic_init(&shard->rejections, 0);
+    atomic_init(&shard->index, new_cache_index(CACHE_INDEX_MIN_SLOTS));
+    /* Initialize the shard lock */
+    if (pthread_rwlock_init(&shard->lock, NULL) != 0)
     {
-        perror("Cannot initialize the cache entry lock\n");
+        perror("Cannot initialize the cache shard lock\n");
         exit(EXIT_FAILURE);
     }
-    return entry;
 }
 
-
 /* get_new_cache
- * Creates a new cache by allocating the memory on the heap
- * @return new cache entry's address.
+ * Creates a new cache by allocating the memory on the heap. Every shard
+ * gets an equal share of 'max_size', which only an entry larger than the
+ * share itself may exceed.
+ * @return new cache's address.
  */
-cache_t* get_new_cache()
+cache_t* get_new_cache(int max_size, int policy, int shards)
 {
-    printf("Cache with maximum %d bytes\n", MAX_CACHE_SIZE);
+    if (shards <= 0 || (shards & (shards - 1)) != 0)
+    {
+        printf("Cache shard count must be a power of two\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Cache with maximum %d bytes in %d shard(s), %s eviction\n",
+           max_size, shards, cache_policy_name(policy));
     cache_t* cache = (cache_t*) Malloc(sizeof(cache_t));
-    cache->total_size = 0;
-    cache->head = NULL;
-    /* Initialize the cache lock */
-    if (pthread_rwlock_init(&cache->lock, NULL) != 0)
+    cache->policy = policy;
+    cache->max_size = max_size;
+    cache->shard_count = shards;
+    cache->shard = aligned_alloc(CACHE_LINE_SIZE,
+                                 shards * sizeof(cache_shard_t));
+    if (cache->shard == NULL)
     {
-        perror("Cannot initialize the cache entry lock\n");
+        perror("Cannot allocate the cache shards");
         exit(EXIT_FAILURE);
     }
+    int i;
+    for (i = 0; i < shards; i++)
+        init_cache_shard(&cache->shard[i], policy, max_size / shards);
+    cache->counters = atomic_fetch_add(&counted_caches, 1);
+    if (cache->counters >= CACHE_COUNTED_CACHES)
+        cache->counters = -1;
     return cache;
 }
 
 /* free_cache_entry
- * Destroys the mutex and frees a given cache entry
+ * Frees a given cache entry
  * @param cache entry to be destroyed.
  */
 void free_cache_entry(cache_entry_t* entry)
 {
-    if (pthread_rwlock_destroy(&entry->lock) != 0)
-    {
-        perror("Can't destroy the cache entry lock\n");
-        exit(EXIT_FAILURE);
-    }
+    if (entry->data != NULL)
+        free(entry->data->key.key_data);
     Free(entry->data); // free the dynamically allocated data.
     Free(entry);
 }
 
-/* Add a new entry into the cache.
- * @param cache cache to which an entry to be added
- * @param entry entry to be added
- *
- * Inserts the cache entry into the cache linkedlist by adding it to the head.
- * @return errocode.
- * */
-int add_to_cache(cache_t* cache, cache_entry_t* entry)
+/* Links the entry in right behind the region's clock hand */
+static void region_link(cache_region_t* region, cache_entry_t* entry)
 {
-    /* Lock the entire cache. We don't want anyone to be reading while we
-     * change the state of the cache pointers */
-    Pthread_rwlock_wrlock(&cache->lock);
-    /* Keep deleting old objects until this object fits in the cache */
-    while ((cache->total_size + entry->data_size) > MAX_CACHE_SIZE)
+    cache_entry_t* hand = region->clock_hand;
+    entry->region = region;
+    if (hand == NULL)
     {
-        /* If the cache doesn't have any entry and can't fit this item
-         * then break */
-        if (cache->total_size == 0)
-        {
-            Pthread_rwlock_unlock(&cache->lock);
-            return CACHE_INSERT_ERR;
-        }
-        delete_lru_entry(cache);
+        /* Empty region */
+        entry->next = NULL;
+        entry->prev = NULL;
+        region->head = entry;
+        region->clock_hand = entry;
+    }
+    else
+    {
+        entry->next = hand;
+        entry->prev = hand->prev;
+        if (hand->prev == NULL)
+            region->head = entry;
+        else
+            hand->prev->next = entry;
+        hand->prev = entry;
     }
+    region->total_size += entry->data_size;
+}
 
-    /* Update the latest timestamp on the added entry */
-    if (gettimeofday(&entry->timestamp, NULL) == -1)
+static void region_unlink(cache_region_t* region, cache_entry_t* entry)
+{
+    if (region->clock_hand == entry)
     {
-        perror("gettimeofday");
-        free_cache_entry(entry);
+        cache_entry_t* next = entry->next ? entry->next : region->head;
+        region->clock_hand = (next == entry) ? NULL : next;
     }
+    if (entry->prev == NULL)
+        region->head = entry->next;
+    else
+        entry->prev->next = entry->next;
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    region->total_size -= entry->data_size;
+    entry->region = NULL;
+}
 
-    cache_entry_t* head = cache->head;
-    if (head == NULL)
+/* Sweeps the region's clock to the first entry not referenced since the
+ * hand last passed it, giving referenced entries a second chance. Every
+ * entry is passed at most twice, and on average a sweep is short as hits
+ * only set a bit which the hand clears. 'skip' is never picked.
+ * @return the victim, left under the hand, or NULL if there is none */
+static cache_entry_t* region_victim(cache_region_t* region,
+                                    cache_entry_t* skip)
+{
+    cache_entry_t* entry = region->clock_hand;
+    if (entry == NULL || (region->head == skip && skip->next == NULL))
+        return NULL;
+    while (entry == skip ||
+           atomic_load_explicit(&entry->referenced, memory_order_relaxed))
     {
-        cache->head = entry;
-        cache->total_size += entry->data_size;
-        Pthread_rwlock_unlock(&cache->lock);
-        return CACHE_INSERT_SUCCESS;
+        /* Second chance */
+        if (entry != skip)
+            atomic_store_explicit(&entry->referenced, 0,
+                                  memory_order_relaxed);
+        entry = entry->next ? entry->next : region->head;
     }
+    region->clock_hand = entry;
+    return entry;
+}
 
-    entry->next = head;
-    entry->prev = NULL;
-    cache->head = entry;
-    entry->next->prev = entry;
-    cache->total_size += entry->data_size;
-    /* Unlock the cache */
-    Pthread_rwlock_unlock(&cache->lock);
-    return CACHE_INSERT_SUCCESS;
+static void remove_from_shard(cache_shard_t* shard, cache_entry_t* entry)
+{
+    region_unlink(entry->region, entry);
+    index_remove(shard, entry);
+    shard->total_size -= entry->data_size;
+    retire(shard, entry, reclaim_entry);
 }
 
-/* delete_lru_entry
- * deletes a Least referenced entry from the cache using LRU algorithm.
- * @param cache cache address.
- * ASSUMPTION: cache lock should be taken before calling this function.
- * @return errcode
- * */
-int delete_lru_entry(cache_t* cache)
+static void evict_entry(cache_shard_t* shard, cache_entry_t* entry)
 {
-    cache_entry_t* temp = cache->head;
-    cache_entry_t* lru_entry = NULL;
-    struct timeval current_time, lru_ts;
+    dbg_printf("Evicted %s \n", entry->data->key.key_data);
+    atomic_fetch_add_explicit(&shard->evictions, 1, memory_order_relaxed);
+    remove_from_shard(shard, entry);
+}
 
-    if (gettimeofday(&current_time, NULL) == -1)
+/* Moves the window's victim to the main region. When the shard is full,
+ * it only gets in by pushing out main entries used less often than itself.
+ * ASSUMPTION: shard write lock is held */
+static void admit_candidate(cache_shard_t* shard, cache_entry_t* candidate)
+{
+    int frequency = sketch_frequency(shard->sketch,
+                                     candidate->data->key.hash);
+    while (shard->total_size > shard->capacity)
     {
-        printf("Error fetching the time\n");
-        return CACHE_DELETE_ERR;
+        cache_entry_t* victim = region_victim(&shard->main, NULL);
+        if (victim == NULL ||
+            frequency <= sketch_frequency(shard->sketch,
+                                          victim->data->key.hash))
+        {
+            atomic_fetch_add_explicit(&shard->rejections, 1,
+                                      memory_order_relaxed);
+            evict_entry(shard, candidate);
+            return;
+        }
+        evict_entry(shard, victim);
     }
+    region_unlink(&shard->window, candidate);
+    region_link(&shard->main, candidate);
+}
 
-    lru_ts = current_time;
-    /* Find LRU entry */
-    while(temp)
+/* Inserts into the window, then makes room for it. The new entry itself is
+ * never evicted here, as the caller may still use it once the lock is
+ * released.
+ * ASSUMPTION: shard write lock is held */
+static void add_to_window(cache_shard_t* shard, cache_entry_t* entry)
+{
+    region_link(&shard->window, entry);
+    shard->total_size += entry->data_size;
+    int window_size = (long)shard->capacity * CACHE_WINDOW_PERCENT / 100;
+    while (shard->window.total_size > window_size)
     {
-        struct timeval ts_tmp;
-        timersub(&current_time, &temp->timestamp, &ts_tmp);
-        if (ts_tmp.tv_sec < lru_ts.tv_sec)
-        {
-            lru_ts = temp->timestamp;
-            lru_entry = temp;
-        }
-        else if (ts_tmp.tv_sec == lru_ts.tv_sec)
-        {
-            if (ts_tmp.tv_usec < lru_ts.tv_usec)
-            {
-                lru_ts = temp->timestamp;
-                lru_entry = temp;
-            }
-        }
-        temp = temp->next;
+        cache_entry_t* candidate = region_victim(&shard->window, entry);
+        if (candidate == NULL)
+            break;
+        admit_candidate(shard, candidate);
     }
+    /* The window can only have grown into the main region's share. An
+     * entry larger than the share is left alone in the shard */
+    while (shard->total_size > shard->capacity)
+    {
+        cache_entry_t* victim = region_victim(&shard->main, NULL);
+        if (victim == NULL)
+            victim = region_victim(&shard->window, entry);
+        if (victim == NULL)
+            break;
+        evict_entry(shard, victim);
+    }
+}
 
+/* delete_lru_entry
+ * deletes a Least recently referenced entry from the shard, as picked by
+ * the clock hand of the main region.
+ * ASSUMPTION: shard lock should be taken before calling this function.
+ * @return errcode
+ * */
+static int delete_lru_entry(cache_shard_t* shard)
+{
+    cache_entry_t* lru_entry = region_victim(&shard->main, NULL);
     if (lru_entry == NULL)
     {
         printf("Error deleting entry from the cache\n");
         return CACHE_DELETE_ERR;
     }
+    evict_entry(shard, lru_entry);
+    return CACHE_DELETE_SUCCESS;
+}
 
-    /* Wait if someone else is using this entry. Possiblity that some thread
-     * might cache this entry and be using. We can't delete until it releases
-     * its read lock */
-    Pthread_rwlock_wrlock(&lru_entry->lock);
-    /* We don't need to acquire prev and next nodes's write locks as we
-     * are assuming that traversals can only happen when the global cache is
-     * read locked and it won't happen while this is executing */
-
-    if (lru_entry->prev == NULL && lru_entry->next == NULL)
+/* Add a new entry into the cache.
+ * @param cache cache to which an entry to be added
+ * @param entry entry to be added
+ *
+ * Inserts the cache entry into its shard's linkedlist right behind the
+ * clock hand, or into the window with W-TinyLFU, and publishes it to
+ * readers. Only entries of the same shard are evicted for it. An entry
+ * larger than the shard's share evicts all of them and keeps the shard to
+ * itself, until the next insertion into the shard evicts it in turn.
+ * ASSUMPTION: shard write lock of the entry's key is held.
+ * @return errocode.
+ * */
+int add_to_cache(cache_t* cache, cache_entry_t* entry)
+{
+    cache_shard_t* shard = shard_of(cache, entry->data->key.hash);
+    /* Can't fit even into an empty cache */
+    if (entry->data_size > cache->max_size)
+        return CACHE_INSERT_ERR;
+    atomic_store_explicit(&entry->referenced, 0, memory_order_relaxed);
+    if (shard->policy == CACHE_POLICY_TINYLFU)
+    {
+        add_to_window(shard, entry);
+    }
+    else
     {
-        cache->head = NULL;
+        /* Keep deleting old objects until this object fits in the shard */
+        while ((shard->total_size + entry->data_size) > shard->capacity &&
+               shard->main.head != NULL)
+            delete_lru_entry(shard);
+        region_link(&shard->main, entry);
+        shard->total_size += entry->data_size;
     }
-    else if (lru_entry->prev == NULL)
+    index_insert(shard, entry);
+    /* Writers free what the readers are done with as they go */
+    reclaim_retired(shard);
+    return CACHE_INSERT_SUCCESS;
+}
+
+/* remove_cache_entry
+ * Unlinks the entry so readers can't find it anymore and retires it. It is
+ * freed once the readers which may hold it are gone.
+ * ASSUMPTION: shard write lock of the entry's key is held.
+ */
+void remove_cache_entry(cache_t* cache, cache_entry_t* entry)
+{
+    cache_shard_t* shard = shard_of(cache, entry->data->key.hash);
+    remove_from_shard(shard, entry);
+    reclaim_retired(shard);
+}
+
+/* replace_cache_entry
+ * Publishes 'replacement', a new version of the entry with the same key, in
+ * its place. The index slot is switched with a single store, so a reader
+ * finds either version and never misses. The old one is retired.
+ * ASSUMPTION: shard write lock of the entry's key is held.
+ */
+void replace_cache_entry(cache_t* cache, cache_entry_t* entry,
+                         cache_entry_t* replacement)
+{
+    cache_shard_t* shard = shard_of(cache, entry->data->key.hash);
+    cache_index_t* index = atomic_load_explicit(&shard->index,
+                                                memory_order_relaxed);
+    size_t mask = index->slots - 1;
+    size_t i = entry->data->key.hash & mask;
+    while (atomic_load_explicit(&index->slot[i].entry,
+                                memory_order_relaxed) != entry)
+        i = (i + 1) & mask;
+
+    /* The new version takes over the old one's place on the clock */
+    cache_region_t* region = entry->region;
+    atomic_store_explicit(&replacement->referenced,
+            atomic_load_explicit(&entry->referenced, memory_order_relaxed),
+            memory_order_relaxed);
+    replacement->region = region;
+    replacement->prev = entry->prev;
+    replacement->next = entry->next;
+    if (entry->prev == NULL)
+        region->head = replacement;
+    else
+        entry->prev->next = replacement;
+    if (entry->next != NULL)
+        entry->next->prev = replacement;
+    if (region->clock_hand == entry)
+        region->clock_hand = replacement;
+    region->total_size += replacement->data_size - entry->data_size;
+    shard->total_size += replacement->data_size - entry->data_size;
+    atomic_store_explicit(&index->slot[i].entry, replacement,
+                          memory_order_release);
+    retire(shard, entry, reclaim_entry);
+    reclaim_retired(shard);
+}
+
+cache_entry_t* peek_cached_item(cache_t* cache, cache_key_t* key)
+{
+    cache_shard_t* shard = shard_of(cache, key->hash);
+    return index_lookup(atomic_load_explicit(&shard->index,
+                                             memory_order_acquire), key);
+}
+
+/* Counts a lookup in the calling thread's reader slot. Only the thread
+ * itself writes there, so no read-modify-write is needed */
+static void count_lookup(cache_t* cache, cache_shard_t* shard, int hit)
+{
+    if (cache->counters < 0)
     {
-        cache->head = lru_entry->next;
-        lru_entry->next->prev = NULL;
+        atomic_fetch_add_explicit(hit ? &shard->hits : &shard->misses, 1,
+                                  memory_order_relaxed);
+        return;
     }
-    else if (lru_entry->next == NULL)
+    cache_reader_t* reader = get_reader();
+    atomic_long* counter = hit ? &reader->hits[cache->counters] :
+                                 &reader->misses[cache->counters];
+    atomic_store_explicit(counter,
+            atomic_load_explicit(counter, memory_order_relaxed) + 1,
+            memory_order_relaxed);
+}
+
+/* Gets the cached data for the given key, and counts the lookup. Must be
+ * called in a read section, or with the key's shard write lock held.
+ * @return cached entry, valid until the read section ends
+ */
+cache_entry_t* get_cached_item(cache_t* cache, cache_key_t* key)
+{
+    cache_shard_t* shard = shard_of(cache, key->hash);
+    cache_entry_t* entry = index_lookup(atomic_load_explicit(&shard->index,
+                                                memory_order_acquire), key);
+    if (shard->sketch != NULL)
+        sketch_increment(shard->sketch, key->hash);
+    count_lookup(cache, shard, entry != NULL);
+    if (entry != NULL)
     {
-        lru_entry->prev->next = NULL;
+        /* Mark it for the clock. Checked first so that hot entries don't
+         * keep bouncing their cache line between the workers */
+        if (!atomic_load_explicit(&entry->referenced, memory_order_relaxed))
+            atomic_store_explicit(&entry->referenced, 1, memory_order_relaxed);
     }
-    else
+    return entry;
+}
+
+/* First entry of the shards from 'index' on */
+static cache_entry_t* shard_first_entry(cache_t* cache, int index)
+{
+    for (; index < cache->shard_count; index++)
     {
-        lru_entry->prev->next = lru_entry->next;
-        lru_entry->next->prev = lru_entry->prev;
+        cache_shard_t* shard = &cache->shard[index];
+        if (shard->window.head != NULL)
+            return shard->window.head;
+        if (shard->main.head != NULL)
+            return shard->main.head;
     }
-    dbg_printf("Evicted %s \n", lru_entry->data->key.key_data);
-    /* Call back is called to perform clean up */
-    if (lru_entry->delete_callback != NULL)
-        lru_entry->delete_callback(lru_entry->data);
-    cache->total_size -= lru_entry->data_size;
-    free_cache_entry(lru_entry);
-    return CACHE_DELETE_SUCCESS;
+    return NULL;
 }
 
+cache_entry_t* cache_first_entry(cache_t* cache)
+{
+    return shard_first_entry(cache, 0);
+}
 
-/* Gets the cached data for the given key. It also read locks the returned item.
- * @return cached entry
- */
-cache_entry_t* get_cached_item_with_lock(cache_t* cache, cache_key_t* key)
+cache_entry_t* cache_next_entry(cache_t* cache, cache_entry_t* entry)
 {
-    /* Take read lock on the cache. Multiple readers can take the data
-     * from the cache. */
-    Pthread_rwlock_rdlock(&cache->lock);
-    cache_entry_t* temp = cache->head;
-    cache_entry_t* result = NULL;
-    while(temp)
+    if (entry->next != NULL)
+        return entry->next;
+    cache_shard_t* shard = shard_of(cache, entry->data->key.hash);
+    if (entry->region == &shard->window && shard->main.head != NULL)
+        return shard->main.head;
+    return shard_first_entry(cache, shard - cache->shard + 1);
+}
+
+void get_cache_stats(cache_t* cache, cache_stats_t* stats)
+{
+    memset(stats, 0, sizeof(cache_stats_t));
+    int i;
+    for (i = 0; i < cache->shard_count; i++)
     {
-        if ((strcmp(temp->data->key.key_data, key->key_data) == 0))
-        {
-            /** Critical Section for updating the timestamp */
-            Pthread_rwlock_wrlock(&temp->lock);
-            if (gettimeofday(&temp->timestamp, NULL) == -1)
-            {
-                perror("gettimeofdat in get");
-                Pthread_rwlock_unlock(&temp->lock);
-                Pthread_rwlock_unlock(&cache->lock);
-                return NULL;
-            }
-            Pthread_rwlock_unlock(&temp->lock);
-            /** End of CS */
-
-            /* Fetch read lock for the caller to use this item */
-            Pthread_rwlock_rdlock(&temp->lock);
-            result = temp;
-            break;
-        }
-        temp = temp->next;
+        cache_shard_t* shard = &cache->shard[i];
+        stats->hits += atomic_load_explicit(&shard->hits,
+                                            memory_order_relaxed);
+        stats->misses += atomic_load_explicit(&shard->misses,
+                                              memory_order_relaxed);
+        stats->evictions += atomic_load_explicit(&shard->evictions,
+                                                 memory_order_relaxed);
+        stats->rejections += atomic_load_explicit(&shard->rejections,
+                                                  memory_order_relaxed);
+    }
+    if (cache->counters < 0)
+        return;
+    int used = atomic_load(&reader_slots_used);
+    for (i = 0; i < used; i++)
+    {
+        stats->hits += atomic_load_explicit(&readers[i].hits[cache->counters],
+                                            memory_order_relaxed);
+        stats->misses += atomic_load_explicit(
+                &readers[i].misses[cache->counters], memory_order_relaxed);
     }
-    Pthread_rwlock_unlock(&cache->lock); /* Unlock read lock on cache */
-    return result;
 }
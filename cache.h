@@ -7,27 +7,63 @@
 #define PROXY_CACHE_H
 
 #include <stdio.h>
-#include <sys/time.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
 #include "util.h"
 
-#define MAX_CACHE_SIZE          (10 * 1024 * 1024) /* 10 Mb */
+#define MAX_CACHE_SIZE          (10 * 1024 * 1024) /* 10 Mb of modules */
 #define CACHE_INSERT_ERR        -3
 #define CACHE_DELETE_ERR        -4
 #define CACHE_INSERT_SUCCESS    0
 #define CACHE_DELETE_SUCCESS    0
-#define MAX_KEY_LENGTH          1000
+#define CACHE_INDEX_MIN_SLOTS   64 /* Power of two */
+#define CACHE_MAX_READERS       1024 /* Threads in a read section at once */
+#define CACHE_DEFAULT_SHARDS    16 /* Power of two */
+#define CACHE_COUNTED_CACHES    8 /* Caches whose lookups every thread counts
+                                     on its own. Later ones share counters */
+#define CACHE_GRACE_POLL_US     1000 /* How often a writer checks whether
+                                        the readers are done */
 
-/* Key. For webserver, its library name */
+/* Eviction policies */
+#define CACHE_POLICY_CLOCK      0 /* Recency only */
+#define CACHE_POLICY_TINYLFU    1 /* W-TinyLFU: frequency based admission
+                                     in front of the clock */
+#define CACHE_WINDOW_PERCENT    1 /* Share of the cache where new entries
+                                     stay before they have to be admitted */
+#define CACHE_SKETCH_BITS       12
+#define CACHE_SKETCH_WIDTH      (1 << CACHE_SKETCH_BITS) /* Counters per row */
+#define CACHE_SKETCH_DEPTH      4 /* Rows of the count-min sketch */
+#define CACHE_SKETCH_MAX_COUNT  15
+#define CACHE_SKETCH_SAMPLES    (10 * CACHE_SKETCH_WIDTH) /* Counters are
+                                     halved after this many increments */
+
+/* Key. For webserver, its library name. The hash is computed once, when
+ * the key is made. A key in the cache owns a copy of its string */
 typedef struct cache_key
 {
-    char key_data[MAX_KEY_LENGTH];
+    char* key_data;
+    size_t length;
+    uint64_t hash;
 }cache_key_t;
 
-/* Value. For webserver, its handle */
+/* Value. For webserver, its handle and the entry points resolved when it
+ * was loaded */
 typedef struct cache_value
 {
     void* value_data;
+    void (*cgi_function)(int fd); /* NULL if the module doesn't export it */
+    /* Identity of the file that was loaded, to tell when it is replaced */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    unsigned version; /* Counts the loads of all modules */
+    int snapshot_fd; /* Private copy the handle was loaded from, or -1 */
+    int cache_ttl_ms; /* How long its responses may be reused, 0 if not */
+    atomic_long runtime_us; /* Average run time of cgi_function, 0 until it
+                               first ran. Updated by the workers */
+    atomic_int slow; /* Served by the slow lane */
 }cache_value_t;
 
 typedef struct cache_data_item
@@ -36,41 +72,162 @@ typedef struct cache_data_item
     cache_value_t value;
 }cache_data_item_t;
 
-/* structure of a cache entry. Read write lock is used to protect this. */
+/* structure of a cache entry. Entries are never changed once published.
+ * A removed entry is freed, and its callback run, only once no reader can
+ * still hold it */
+struct cache_region;
+
 typedef struct cache_entry
 {
     cache_data_item_t* data;
-    pthread_rwlock_t lock;
     int data_size;
     void (*delete_callback)(cache_data_item_t*); /* This is called when the
                                                     item is evicted from the
                                                     cache */
-    struct timeval timestamp;
+    atomic_int referenced; /* Set on every hit, cleared by the clock */
+    struct cache_region* region; /* List it is linked in */
     struct cache_entry* next;
     struct cache_entry* prev;
 }cache_entry_t;
 
-typedef struct cache
+/* List of entries with a clock of its own */
+typedef struct cache_region
 {
-    pthread_rwlock_t lock;
     cache_entry_t* head;
+    cache_entry_t* clock_hand; /* Next eviction candidate */
+    int total_size;
+}cache_region_t;
+
+/* Count-min sketch of how often keys were looked up lately. Updated by the
+ * readers without locks; a lost increment only makes an estimate lower */
+typedef struct cache_sketch
+{
+    atomic_uchar count[CACHE_SKETCH_DEPTH][CACHE_SKETCH_WIDTH];
+    atomic_int samples; /* Increments since the counters were halved */
+}cache_sketch_t;
+
+typedef struct cache_stats
+{
+    long hits;
+    long misses;
+    long evictions;
+    long rejections; /* New entries W-TinyLFU did not admit */
+}cache_stats_t;
+
+/* Slot of the hash index. The hash is kept next to the entry so a probe
+ * only dereferences an entry whose hash matches */
+typedef struct cache_index_slot
+{
+    _Atomic uint64_t hash;
+    _Atomic(cache_entry_t*) entry; /* NULL if the slot is free */
+}cache_index_slot_t;
+
+/* Open addressing index over the entries of the list, linear probing.
+ * Kept at most half full. A grown index replaces the old one, which is
+ * freed like a removed entry */
+typedef struct cache_index
+{
+    size_t slots;
+    cache_index_slot_t slot[];
+}cache_index_t;
+
+/* Entry or index waiting for the readers which may still see it */
+typedef struct cache_retired
+{
+    void* object;
+    void (*reclaim)(void*);
+    uint64_t epoch; /* Epoch in which it was removed */
+    struct cache_retired* next;
+}cache_retired_t;
+
+/* A key's shard is picked by its hash. Every shard is a cache of its own,
+ * with its own writer lock, index, eviction and share of the size */
+typedef struct cache_shard
+{
+    _Alignas(CACHE_LINE_SIZE) pthread_rwlock_t lock; /* Taken by writers
+                                                        only */
+    int policy;
+    /* With CLOCK, all of the entries are in 'main'. With W-TinyLFU new
+     * entries start in 'window' */
+    cache_region_t window;
+    cache_region_t main;
     int total_size;
+    int capacity;
+    _Atomic(cache_index_t*) index;
+    size_t index_count;
+    cache_retired_t* retired;
+    cache_sketch_t* sketch; /* Only for W-TinyLFU */
+    /* Lookups, if the cache has no counters in the reader slots. Updated
+     * by the readers */
+    _Alignas(CACHE_LINE_SIZE) atomic_long hits;
+    atomic_long misses;
+    /* Updated under the writer lock */
+    atomic_long evictions;
+    atomic_long rejections;
+}cache_shard_t;
+
+typedef struct cache
+{
+    int policy;
+    int max_size;
+    int shard_count;
+    cache_shard_t* shard;
+    int counters; /* Index of its lookup counters in the reader slots, -1
+                     if it counts in its shards */
 }cache_t;
 
-/* Create cache structures */
-cache_t* get_new_cache();
+/* Create cache structures. 'max_size' is split evenly between the shards
+ * and bounds the data_size of their entries, except that a shard may hold
+ * a single entry larger than its share. No entry may exceed 'max_size'.
+ * 'policy' is one of CACHE_POLICY_*, 'shards' a power of two */
+cache_t* get_new_cache(int max_size, int policy, int shards);
 cache_entry_t* get_new_cache_entry();
 
-/* Put, Get, and Delete */
+/* Keys. init makes a key pointing to 'data', copy gives 'dst' its own
+ * string */
+void init_cache_key(cache_key_t* key, char* data);
+void copy_cache_key(cache_key_t* dst, cache_key_t* src);
+
+/* Read sections. Entries returned by get_cached_item stay valid until the
+ * section ends. A reader must not take the writer lock inside a section */
+void cache_read_begin();
+void cache_read_end();
+
+/* Put, Get, and Delete. Put and Delete need the writer lock of the key's
+ * shard, and free what was removed earlier once no reader can hold it */
 int add_to_cache(cache_t* cache, cache_entry_t* entry);
-int delete_lru_entry(cache_t* cache);
-cache_entry_t* get_cached_item_with_lock(cache_t* cache, cache_key_t* key);
+void remove_cache_entry(cache_t* cache, cache_entry_t* entry);
+void replace_cache_entry(cache_t* cache, cache_entry_t* entry,
+                         cache_entry_t* replacement);
+cache_entry_t* get_cached_item(cache_t* cache, cache_key_t* key);
+/* Same, but not counted as a use of the entry. For writers checking what
+ * is cached */
+cache_entry_t* peek_cached_item(cache_t* cache, cache_key_t* key);
+
+/* Walks all of the entries. Needs the global writer lock */
+cache_entry_t* cache_first_entry(cache_t* cache);
+cache_entry_t* cache_next_entry(cache_t* cache, cache_entry_t* entry);
+
+/* Waits until no reader can see the entries removed so far and frees
+ * them. Must be called without any writer lock, it takes the shards' ones
+ * only to free them */
+void synchronize_cache(cache_t* cache);
+
+/* Frees the removed entries no reader can see anymore, leaving the others
+ * for a later call. Never waits for the readers. Must be called without
+ * any writer lock */
+void reclaim_cache(cache_t* cache);
 
 /* Misc */
-void display_cache();
+void display_cache(cache_t* cache);
+void get_cache_stats(cache_t* cache, cache_stats_t* stats);
+const char* cache_policy_name(int policy);
 void free_cache_entry(cache_entry_t* entry);
 
-/* Global coarse rw locks */
+/* Writer lock of the shard of 'key' */
+void get_cache_shard_wrlock(cache_t* cache, cache_key_t* key);
+void release_cache_shard_wrlock(cache_t* cache, cache_key_t* key);
+/* Global coarse writer locks, all of the shards */
 void get_global_cache_wrlock(cache_t* cache);
 void release_global_cache_wrlock(cache_t* cache);
 #endif /* End of header */
@@ -0,0 +1,813 @@
+/* Module cache benchmark and stress test.
+ * ***************************************
+ * Runs threads doing a mix of operations on a cache of modules:
+ *  - read: looks a module up like a request does, and loads it under the
+ *    writer lock of its shard on a miss, unless another thread did
+ *    meanwhile, like a worker does.
+ *  - insert: loads a new version of the module, like a redeploy does.
+ *  - remove: drops the module, like an invalidation does.
+ * Modules are picked uniformly or with a Zipf distribution. Reports the
+ * operations per second, the hit ratio, percentiles of the lookup latency
+ * and of the time spent waiting for shard writer locks.
+ *
+ * With -x, the same mix runs as a stress test. Every module carries a value
+ * which the readers check, and which is poisoned when the cache frees it,
+ * so a reader finding a freed or mismatched entry fails the run. At the end
+ * every value has to be either freed exactly once or still cached, and the
+ * size accounting of every shard has to match its entries.
+ *
+ * With -T, runs the mix once per thread count of a list, in a cache of one
+ * shard and in the sharded one, and prints a line per run. With -K, runs
+ * it once per module count of a list, with modules small enough to all fit
+ * in the cache, to show how the lookup cost grows with the number of
+ * modules.
+ *
+ * With -H, compares the hit ratio of the eviction policies on a hot set of
+ * modules interrupted by scans of modules used once. Given a trace file,
+ * with a module name and optionally its size per line, it replays the trace
+ * through both policies instead.
+ * Build with 'make cache_bench'.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "cache.h"
+#include "csapp.h"
+
+#define BENCH_MAX_THREADS   256
+#define BENCH_MAX_SAMPLES   (1 << 20) /* Latencies kept per thread */
+#define BENCH_NAME_LENGTH   64
+#define BENCH_MAX_SWEEP     32 /* Values of a -T or -K list */
+#define MODULE_SIZE     (64 * 1024) /* Of the modules of the hit ratio
+                                       runs, unless a trace says */
+#define HOT_MODULES     120 /* Fit in the cache, scans don't */
+#define HOT_LOOKUPS     2000 /* Between two scans */
+#define SCAN_MODULES    400
+#define SCAN_ROUNDS     50
+#define STRESS_VALUE_LIVE   0x11FE11FE
+#define STRESS_VALUE_DEAD   0xDEADDEAD
+#define STRESS_READ_SPIN    64 /* Reader holds an entry that long */
+
+#define KEY_DIST_UNIFORM    0
+#define KEY_DIST_ZIPF       1
+
+typedef struct bench_config
+{
+    int threads;
+    int ops;            /* Per thread */
+    int keys;
+    int cached_keys;    /* How many modules fit in the cache */
+    int distribution;
+    double skew;
+    int read_percent;
+    int insert_percent; /* The rest are removals */
+    int policy;
+    int shards;
+    int stress;
+    int sweep;          /* One line per run */
+}bench_config_t;
+
+/* Collected latencies, in ns */
+typedef struct samples
+{
+    unsigned* values;
+    int count;
+}samples_t;
+
+typedef struct bench_thread
+{
+    cache_t* cache;
+    uint64_t seed;
+    long hits;
+    long misses;
+    long inserts;
+    long removals;
+    int stride; /* One operation out of 'stride' has its lookup timed */
+    samples_t lookups;
+    samples_t lock_waits;
+}bench_thread_t;
+
+/* Value of the modules of a stress run */
+typedef struct stress_value
+{
+    atomic_uint magic;
+    uint64_t hash; /* Of the key it was created for */
+}stress_value_t;
+
+/* Lookups replayed by the hit ratio runs */
+typedef struct trace
+{
+    char** names;
+    int* sizes;
+    int count;
+    int capacity;
+}trace_t;
+
+static bench_config_t config;
+static char (*names)[BENCH_NAME_LENGTH];
+static double* zipf_cdf; /* Probability of picking key 0 up to i */
+static atomic_long values_created;
+static atomic_long values_freed;
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* xorshift64*, cheaper than rand_r and good enough for picking keys */
+static uint64_t next_random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* @return uniform in [0, 1) */
+static double next_unit(uint64_t* state)
+{
+    return (next_random(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static void init_zipf(int keys, double skew)
+{
+    zipf_cdf = (double*)Realloc(zipf_cdf, keys * sizeof(double));
+    double sum = 0;
+    int i;
+    for (i = 0; i < keys; i++)
+    {
+        sum += 1.0 / pow(i + 1, skew);
+        zipf_cdf[i] = sum;
+    }
+    for (i = 0; i < keys; i++)
+        zipf_cdf[i] /= sum;
+}
+
+static int pick_key(uint64_t* state)
+{
+    if (config.distribution == KEY_DIST_UNIFORM)
+        return next_random(state) % config.keys;
+    double u = next_unit(state);
+    int low = 0, high = config.keys - 1;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (zipf_cdf[mid] < u)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+static void add_sample(samples_t* samples, double ns)
+{
+    if (samples->count < BENCH_MAX_SAMPLES)
+        samples->values[samples->count++] = ns;
+}
+
+static void stress_value_freed(cache_data_item_t* item)
+{
+    stress_value_t* value = (stress_value_t*)item->value.value_data;
+    if (atomic_exchange(&value->magic, STRESS_VALUE_DEAD) != STRESS_VALUE_LIVE)
+    {
+        printf("FAILED: value of %s freed twice\n", item->key.key_data);
+        exit(EXIT_FAILURE);
+    }
+    if (value->hash != item->key.hash)
+    {
+        printf("FAILED: value of %s freed with another key\n",
+               item->key.key_data);
+        exit(EXIT_FAILURE);
+    }
+    /* Kept poisoned rather than freed, so that a late reader sees it */
+    atomic_fetch_add(&values_freed, 1);
+}
+
+static cache_entry_t* new_module(cache_key_t* key)
+{
+    cache_entry_t* entry = get_new_cache_entry();
+    entry->data = Malloc(sizeof(cache_data_item_t));
+    memset(entry->data, 0, sizeof(cache_data_item_t));
+    copy_cache_key(&entry->data->key, key);
+    entry->data_size = MAX_CACHE_SIZE / config.cached_keys;
+    if (config.stress)
+    {
+        stress_value_t* value = Malloc(sizeof(stress_value_t));
+        atomic_init(&value->magic, STRESS_VALUE_LIVE);
+        value->hash = key->hash;
+        entry->data->value.value_data = value;
+        entry->delete_callback = stress_value_freed;
+        atomic_fetch_add(&values_created, 1);
+    }
+    return entry;
+}
+
+/* Entry which never made it into the cache */
+static void drop_module(cache_entry_t* entry)
+{
+    if (entry->delete_callback != NULL)
+        entry->delete_callback(entry->data);
+    free_cache_entry(entry);
+}
+
+static void check_entry(cache_entry_t* entry, cache_key_t* key)
+{
+    stress_value_t* value = (stress_value_t*)entry->data->value.value_data;
+    if (strcmp(entry->data->key.key_data, key->key_data) != 0 ||
+        value->hash != key->hash)
+    {
+        printf("FAILED: lookup of %s found %s\n", key->key_data,
+               entry->data->key.key_data);
+        exit(EXIT_FAILURE);
+    }
+    if (atomic_load(&value->magic) != STRESS_VALUE_LIVE)
+    {
+        printf("FAILED: lookup of %s found a freed entry\n", key->key_data);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Takes the writer lock of the key's shard, timing the wait */
+static void lock_shard(bench_thread_t* thread, cache_key_t* key)
+{
+    double start = now_ns();
+    get_cache_shard_wrlock(thread->cache, key);
+    add_sample(&thread->lock_waits, now_ns() - start);
+}
+
+static void read_module(bench_thread_t* thread, cache_key_t* key, int timed)
+{
+    cache_t* cache = thread->cache;
+    double start = timed ? now_ns() : 0;
+    cache_read_begin();
+    cache_entry_t* entry = get_cached_item(cache, key);
+    if (entry != NULL && config.stress)
+    {
+        volatile int spin;
+        check_entry(entry, key);
+        for (spin = 0; spin < STRESS_READ_SPIN; spin++);
+        check_entry(entry, key);
+    }
+    cache_read_end();
+    if (timed)
+        add_sample(&thread->lookups, now_ns() - start);
+    if (entry != NULL)
+    {
+        thread->hits++;
+        return;
+    }
+    thread->misses++;
+    cache_entry_t* module = new_module(key);
+    lock_shard(thread, key);
+    if (peek_cached_item(cache, key) != NULL ||
+        add_to_cache(cache, module) == CACHE_INSERT_ERR)
+    {
+        /* Loaded by another thread meanwhile */
+        drop_module(module);
+    }
+    release_cache_shard_wrlock(cache, key);
+}
+
+static void insert_module(bench_thread_t* thread, cache_key_t* key)
+{
+    cache_t* cache = thread->cache;
+    cache_entry_t* module = new_module(key);
+    lock_shard(thread, key);
+    cache_entry_t* current = peek_cached_item(cache, key);
+    if (current != NULL)
+        replace_cache_entry(cache, current, module);
+    else if (add_to_cache(cache, module) == CACHE_INSERT_ERR)
+        drop_module(module);
+    release_cache_shard_wrlock(cache, key);
+    thread->inserts++;
+}
+
+static void remove_module(bench_thread_t* thread, cache_key_t* key)
+{
+    cache_t* cache = thread->cache;
+    lock_shard(thread, key);
+    cache_entry_t* current = peek_cached_item(cache, key);
+    if (current != NULL)
+        remove_cache_entry(cache, current);
+    release_cache_shard_wrlock(cache, key);
+    thread->removals++;
+}
+
+static void* bench_thread(void* arg)
+{
+    bench_thread_t* thread = (bench_thread_t*)arg;
+    int i;
+    for (i = 0; i < config.ops; i++)
+    {
+        cache_key_t key;
+        init_cache_key(&key, names[pick_key(&thread->seed)]);
+        int op = next_random(&thread->seed) % 100;
+        if (op < config.read_percent)
+            read_module(thread, &key, i % thread->stride == 0);
+        else if (op < config.read_percent + config.insert_percent)
+            insert_module(thread, &key);
+        else
+            remove_module(thread, &key);
+    }
+    return NULL;
+}
+
+static int compare_samples(const void* a, const void* b)
+{
+    unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Merges the samples of all of the threads, sorted */
+static samples_t merge_samples(bench_thread_t* threads, size_t offset)
+{
+    samples_t merged;
+    int i;
+    merged.count = 0;
+    for (i = 0; i < config.threads; i++)
+        merged.count += ((samples_t*)((char*)&threads[i] + offset))->count;
+    merged.values = (unsigned*)Malloc((merged.count + 1) * sizeof(unsigned));
+    merged.count = 0;
+    for (i = 0; i < config.threads; i++)
+    {
+        samples_t* samples = (samples_t*)((char*)&threads[i] + offset);
+        memcpy(merged.values + merged.count, samples->values,
+               samples->count * sizeof(unsigned));
+        merged.count += samples->count;
+    }
+    qsort(merged.values, merged.count, sizeof(unsigned), compare_samples);
+    return merged;
+}
+
+static unsigned percentile(samples_t* samples, double percent)
+{
+    if (samples->count == 0)
+        return 0;
+    int index = (int)(samples->count * percent / 100);
+    if (index >= samples->count)
+        index = samples->count - 1;
+    return samples->values[index];
+}
+
+static void print_percentiles(char* name, samples_t* samples)
+{
+    double sum = 0;
+    int i;
+    for (i = 0; i < samples->count; i++)
+        sum += samples->values[i];
+    printf("%-12s %10d %8.0f %8u %8u %8u %8u %10u\n", name, samples->count,
+           samples->count ? sum / samples->count : 0.0,
+           percentile(samples, 50), percentile(samples, 90),
+           percentile(samples, 99), percentile(samples, 99.9),
+           samples->count ? samples->values[samples->count - 1] : 0);
+}
+
+/* Checks the cache once every thread stopped: every value is freed once or
+ * still cached, and the sizes of the shards match their entries */
+static void check_cache(cache_t* cache)
+{
+    synchronize_cache(cache);
+    get_global_cache_wrlock(cache);
+    long cached = 0;
+    long size = 0, total_size = 0;
+    cache_entry_t* entry;
+    for (entry = cache_first_entry(cache); entry != NULL;
+         entry = cache_next_entry(cache, entry))
+    {
+        stress_value_t* value = (stress_value_t*)entry->data->value.value_data;
+        if (atomic_load(&value->magic) != STRESS_VALUE_LIVE)
+        {
+            printf("FAILED: %s is cached but freed\n",
+                   entry->data->key.key_data);
+            exit(EXIT_FAILURE);
+        }
+        if (peek_cached_item(cache, &entry->data->key) != entry)
+        {
+            printf("FAILED: %s is not indexed\n", entry->data->key.key_data);
+            exit(EXIT_FAILURE);
+        }
+        cached++;
+        size += entry->data_size;
+    }
+    int i;
+    for (i = 0; i < cache->shard_count; i++)
+    {
+        cache_shard_t* shard = &cache->shard[i];
+        /* Only a single entry may be larger than the share */
+        cache_entry_t* first = shard->main.head ? shard->main.head
+                                                : shard->window.head;
+        int alone = first != NULL && first->next == NULL &&
+                    (shard->main.head == NULL || shard->window.head == NULL);
+        if (shard->total_size > shard->capacity && !alone)
+        {
+            printf("FAILED: shard %d holds %d of %d bytes\n", i,
+                   shard->total_size, shard->capacity);
+            exit(EXIT_FAILURE);
+        }
+        total_size += shard->total_size;
+    }
+    release_global_cache_wrlock(cache);
+    long created = atomic_load(&values_created);
+    long freed = atomic_load(&values_freed);
+    if (created != freed + cached)
+    {
+        printf("FAILED: %ld values created, %ld freed, %ld cached\n", created,
+               freed, cached);
+        exit(EXIT_FAILURE);
+    }
+    if (size != total_size)
+    {
+        printf("FAILED: entries hold %ld bytes, shards account %ld\n", size,
+               total_size);
+        exit(EXIT_FAILURE);
+    }
+    printf("OK: %ld values created, %ld freed, %ld cached\n", created, freed,
+           cached);
+}
+
+static void run_bench()
+{
+    static bench_thread_t threads[BENCH_MAX_THREADS];
+    pthread_t tids[BENCH_MAX_THREADS];
+    cache_t* cache = get_new_cache(MAX_CACHE_SIZE, config.policy,
+                                   config.shards);
+    int i;
+    /* Counted per run, a stress check only looks at this cache */
+    atomic_store(&values_created, 0);
+    atomic_store(&values_freed, 0);
+    for (i = 0; i < config.threads; i++)
+    {
+        memset(&threads[i], 0, sizeof(bench_thread_t));
+        threads[i].cache = cache;
+        threads[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        threads[i].stride = config.ops / BENCH_MAX_SAMPLES + 1;
+        threads[i].lookups.values =
+                (unsigned*)Malloc(BENCH_MAX_SAMPLES * sizeof(unsigned));
+        threads[i].lock_waits.values =
+                (unsigned*)Malloc(BENCH_MAX_SAMPLES * sizeof(unsigned));
+    }
+    double start = now_ns();
+    for (i = 0; i < config.threads; i++)
+        Pthread_create(&tids[i], NULL, bench_thread, &threads[i]);
+    for (i = 0; i < config.threads; i++)
+        Pthread_join(tids[i], NULL);
+    double elapsed = now_ns() - start;
+
+    long hits = 0, misses = 0, inserts = 0, removals = 0;
+    for (i = 0; i < config.threads; i++)
+    {
+        hits += threads[i].hits;
+        misses += threads[i].misses;
+        inserts += threads[i].inserts;
+        removals += threads[i].removals;
+    }
+    cache_stats_t stats;
+    get_cache_stats(cache, &stats);
+    long ops = (long)config.ops * config.threads;
+    samples_t lookups = merge_samples(threads,
+                                      offsetof(bench_thread_t, lookups));
+    samples_t lock_waits = merge_samples(threads,
+                                         offsetof(bench_thread_t, lock_waits));
+    for (i = 0; i < config.threads; i++)
+    {
+        Free(threads[i].lookups.values);
+        Free(threads[i].lock_waits.values);
+    }
+    if (config.sweep)
+    {
+        printf("%8d %7d %7d %9.3f %7.1f%% %8u %8u %10u %10u\n",
+               config.threads, cache->shard_count, config.keys,
+               ops / elapsed * 1e3,
+               hits + misses ? 100.0 * hits / (hits + misses) : 0,
+               percentile(&lookups, 50), percentile(&lookups, 99),
+               percentile(&lock_waits, 50), percentile(&lock_waits, 99));
+        Free(lookups.values);
+        Free(lock_waits.values);
+        if (config.stress)
+            check_cache(cache);
+        return;
+    }
+    char distribution[32] = "uniform";
+    if (config.distribution == KEY_DIST_ZIPF)
+        snprintf(distribution, sizeof(distribution), "zipf %.2f", config.skew);
+    printf("%d thread(s), %d shard(s), %s, %d keys, %d fit, %s, "
+           "mix %d/%d/%d\n", config.threads, cache->shard_count,
+           cache_policy_name(config.policy), config.keys, config.cached_keys,
+           distribution, config.read_percent, config.insert_percent,
+           100 - config.read_percent - config.insert_percent);
+    printf("%.3f Mops/s\treads %ld (hit ratio %.1f%%)\tinserts %ld\t"
+           "removals %ld\tevicted %ld\trejected %ld\n", ops / elapsed * 1e3,
+           hits + misses, hits + misses ? 100.0 * hits / (hits + misses) : 0,
+           inserts, removals, stats.evictions, stats.rejections);
+
+    printf("%-12s %10s %8s %8s %8s %8s %8s %10s\n", "ns", "SAMPLES", "MEAN",
+           "P50", "P90", "P99", "P99.9", "MAX");
+    print_percentiles("lookup", &lookups);
+    print_percentiles("lock wait", &lock_waits);
+    Free(lookups.values);
+    Free(lock_waits.values);
+    if (config.stress)
+        check_cache(cache);
+}
+
+static void print_sweep_header()
+{
+    config.sweep = 1;
+    printf("%8s %7s %7s %9s %8s %8s %8s %10s %10s\n", "THREADS", "SHARDS",
+           "KEYS", "Mops/s", "HITS", "LOOK P50", "LOOK P99", "LOCK P50",
+           "LOCK P99");
+}
+
+/* Names the modules and sets up the key distribution */
+static void init_keys()
+{
+    int i;
+    names = Realloc(names, config.keys * sizeof(*names));
+    for (i = 0; i < config.keys; i++)
+        snprintf(names[i], BENCH_NAME_LENGTH, "./cgi-bin/module%d.so", i);
+    if (config.distribution == KEY_DIST_ZIPF)
+        init_zipf(config.keys, config.skew);
+}
+
+/* Each thread count with one shard, then with the configured ones */
+static void sweep_threads(int* counts, int runs)
+{
+    int shards = config.shards;
+    int i;
+    print_sweep_header();
+    init_keys();
+    for (i = 0; i < runs; i++)
+    {
+        config.threads = counts[i];
+        config.shards = 1;
+        run_bench();
+        if (shards == 1)
+            continue;
+        config.shards = shards;
+        run_bench();
+    }
+}
+
+/* Each module count with modules of a byte, so that all of them fit in
+ * any shard and the runs differ only by the number of modules indexed */
+static void sweep_keys(int* counts, int runs)
+{
+    int i;
+    print_sweep_header();
+    config.cached_keys = MAX_CACHE_SIZE;
+    for (i = 0; i < runs; i++)
+    {
+        config.keys = counts[i];
+        init_keys();
+        run_bench();
+    }
+}
+
+static void trace_add(trace_t* trace, char* name, int size)
+{
+    if (trace->count == trace->capacity)
+    {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 1024;
+        trace->names = (char**)Realloc(trace->names,
+                                       trace->capacity * sizeof(char*));
+        trace->sizes = (int*)Realloc(trace->sizes,
+                                     trace->capacity * sizeof(int));
+    }
+    trace->names[trace->count] = strdup(name);
+    trace->sizes[trace->count++] = size;
+}
+
+/* Looks every module of the trace up like a request does and loads the
+ * ones missing, with the given policy.
+ * @return hit ratio in percent */
+static double replay(trace_t* trace, int policy)
+{
+    cache_t* cache = get_new_cache(MAX_CACHE_SIZE, policy, 1);
+    int i;
+    for (i = 0; i < trace->count; i++)
+    {
+        cache_key_t key;
+        init_cache_key(&key, trace->names[i]);
+        cache_read_begin();
+        cache_entry_t* entry = get_cached_item(cache, &key);
+        cache_read_end();
+        if (entry != NULL)
+            continue;
+        entry = get_new_cache_entry();
+        entry->data = Malloc(sizeof(cache_data_item_t));
+        memset(entry->data, 0, sizeof(cache_data_item_t));
+        copy_cache_key(&entry->data->key, &key);
+        entry->data_size = trace->sizes[i];
+        get_cache_shard_wrlock(cache, &key);
+        if (add_to_cache(cache, entry) == CACHE_INSERT_ERR)
+            free_cache_entry(entry);
+        release_cache_shard_wrlock(cache, &key);
+    }
+    cache_stats_t stats;
+    get_cache_stats(cache, &stats);
+    return 100.0 * stats.hits / (stats.hits + stats.misses);
+}
+
+/* Hot modules, skewed towards the first ones, and every HOT_LOOKUPS a scan
+ * of modules which are never used again */
+static void make_scan_trace(trace_t* trace)
+{
+    unsigned seed = 1;
+    char name[BENCH_NAME_LENGTH];
+    int round, i;
+    for (round = 0; round < SCAN_ROUNDS; round++)
+    {
+        for (i = 0; i < HOT_LOOKUPS; i++)
+        {
+            int hot = rand_r(&seed) % (1 + rand_r(&seed) % HOT_MODULES);
+            snprintf(name, sizeof(name), "./cgi-bin/hot%d.so", hot);
+            trace_add(trace, name, MODULE_SIZE);
+        }
+        for (i = 0; i < SCAN_MODULES; i++)
+        {
+            snprintf(name, sizeof(name), "./cgi-bin/scan%d_%d.so", round, i);
+            trace_add(trace, name, MODULE_SIZE);
+        }
+    }
+}
+
+/* Reads "<module> [size]" lines */
+static void read_trace(trace_t* trace, char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    char line[512], name[256];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        int size = MODULE_SIZE;
+        if (sscanf(line, "%255s %d", name, &size) >= 1)
+            trace_add(trace, name, size);
+    }
+    fclose(file);
+}
+
+static void print_hit_ratios(char* workload, trace_t* trace)
+{
+    printf("%-16s %8s %12s %12s\n", "WORKLOAD", "LOOKUPS", "CLOCK",
+           "W-TinyLFU");
+    double clock = replay(trace, CACHE_POLICY_CLOCK);
+    double tinylfu = replay(trace, CACHE_POLICY_TINYLFU);
+    printf("%-16s %8d %11.1f%% %11.1f%%\n", workload, trace->count, clock,
+           tinylfu);
+}
+
+static void usage(char* program)
+{
+    printf("Usage: %s [-t threads] [-n ops_per_thread] [-k keys] "
+           "[-c cached_keys] [-d uniform|zipf] [-s skew] "
+           "[-m read,insert,remove] [-e clock|tinylfu] [-S shards] [-x]\n"
+           "       [-T threads,threads,...] [-K keys,keys,...]\n"
+           "       %s -H [trace]\n", program, program);
+    exit(EXIT_FAILURE);
+}
+
+static int positive_arg(char* program)
+{
+    int value = atoi(optarg);
+    if (value <= 0)
+        usage(program);
+    return value;
+}
+
+/* Parses a comma separated list of positive numbers.
+ * @return count of the numbers */
+static int list_arg(char* program, int* values, int max_value)
+{
+    int count = 0;
+    char* item = strtok(optarg, ",");
+    while (item != NULL)
+    {
+        int value = atoi(item);
+        if (count == BENCH_MAX_SWEEP || value <= 0 || value > max_value)
+            usage(program);
+        values[count++] = value;
+        item = strtok(NULL, ",");
+    }
+    if (count == 0)
+        usage(program);
+    return count;
+}
+
+int main(int argc, char* argv[])
+{
+    int hit_ratios = 0;
+    int sweep[BENCH_MAX_SWEEP];
+    int thread_runs = 0, key_runs = 0;
+    int opt;
+    config.threads = 4;
+    config.ops = 1 << 18;
+    config.keys = 4096;
+    config.cached_keys = 1024;
+    config.distribution = KEY_DIST_ZIPF;
+    config.skew = 0.99;
+    config.read_percent = 90;
+    config.insert_percent = 8;
+    config.policy = CACHE_POLICY_CLOCK;
+    config.shards = CACHE_DEFAULT_SHARDS;
+    while ((opt = getopt(argc, argv, "t:n:k:c:d:s:m:e:S:xHT:K:")) != -1)
+    {
+        int removals;
+        switch (opt)
+        {
+            case 't':   config.threads = positive_arg(argv[0]);
+                        if (config.threads > BENCH_MAX_THREADS)
+                            usage(argv[0]);
+                        break;
+            case 'n':   config.ops = positive_arg(argv[0]);
+                        break;
+            case 'k':   config.keys = positive_arg(argv[0]);
+                        break;
+            case 'c':   config.cached_keys = positive_arg(argv[0]);
+                        break;
+            case 'd':   if (strcmp(optarg, "uniform") == 0)
+                            config.distribution = KEY_DIST_UNIFORM;
+                        else if (strcmp(optarg, "zipf") == 0)
+                            config.distribution = KEY_DIST_ZIPF;
+                        else
+                            usage(argv[0]);
+                        break;
+            case 's':   config.skew = atof(optarg);
+                        if (config.skew <= 0)
+                            usage(argv[0]);
+                        break;
+            case 'm':   if (sscanf(optarg, "%d,%d,%d", &config.read_percent,
+                                   &config.insert_percent, &removals) != 3 ||
+                            config.read_percent < 0 ||
+                            config.insert_percent < 0 || removals < 0 ||
+                            config.read_percent + config.insert_percent +
+                            removals != 100)
+                        {
+                            printf("The mix is three percentages adding up "
+                                   "to 100\n");
+                            exit(EXIT_FAILURE);
+                        }
+                        break;
+            case 'e':   if (strcmp(optarg, "clock") == 0)
+                            config.policy = CACHE_POLICY_CLOCK;
+                        else if (strcmp(optarg, "tinylfu") == 0)
+                            config.policy = CACHE_POLICY_TINYLFU;
+                        else
+                            usage(argv[0]);
+                        break;
+            case 'S':   config.shards = positive_arg(argv[0]);
+                        break;
+            case 'x':   config.stress = 1;
+                        break;
+            case 'H':   hit_ratios = 1;
+                        break;
+            case 'T':   thread_runs = list_arg(argv[0], sweep,
+                                               BENCH_MAX_THREADS);
+                        key_runs = 0;
+                        break;
+            case 'K':   key_runs = list_arg(argv[0], sweep, INT_MAX);
+                        thread_runs = 0;
+                        break;
+            default:    usage(argv[0]);
+        }
+    }
+
+    if (hit_ratios)
+    {
+        trace_t trace;
+        memset(&trace, 0, sizeof(trace));
+        if (optind < argc)
+        {
+            read_trace(&trace, argv[optind]);
+            print_hit_ratios(argv[optind], &trace);
+        }
+        else
+        {
+            make_scan_trace(&trace);
+            print_hit_ratios("hot+scan", &trace);
+        }
+        return 0;
+    }
+
+    if (thread_runs > 0)
+        sweep_threads(sweep, thread_runs);
+    else if (key_runs > 0)
+        sweep_keys(sweep, key_runs);
+    else
+    {
+        init_keys();
+        run_bench();
+    }
+    return 0;
+}
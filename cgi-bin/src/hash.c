@@ -2,6 +2,9 @@
 #include <time.h>
 #include <openssl/md5.h>
 
+/* The page only changes once a second. Lets the server reuse it meanwhile */
+int cgi_cache_ttl_ms = 1000;
+
 void cgi_function(int fd)
 {
 
@@ -2,6 +2,9 @@
 #include<string.h>
 #include <time.h>
 
+/* The page only changes once a second. Lets the server reuse it meanwhile */
+int cgi_cache_ttl_ms = 1000;
+
 void cgi_function(int fd)
 {
     time_t current_time;
@@ -21,6 +21,8 @@
 #define HTTP_ERR_HEADER_KEY_VALUE_INVALID 4
 #define HTTP_PARSE_ERROR                5
 #define HTTP_INVALID_PROTOCOL           6
+#define HTTP_PARSE_INCOMPLETE           7 /* Need more input */
+#define HTTP_HEADER_END                 8 /* Empty line ending the header */
 
 /* HTTP response codes for errors */
 #define HTTP_ERR_CODE_BAD_REQUEST       400
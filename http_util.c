@@ -7,6 +7,7 @@
 #include "http_util.h"
 #include "csapp.h"
 #include <stdbool.h>
+#include <strings.h>
 
 /* Determines the resource type from URL and writes the resource name back.
  * Ex: /cgi-bin/vamshi has resource type of RESOURCE_TYPE_CGI_BIN and
@@ -47,12 +48,160 @@ int http_write_response_header(int clientfd, int http_response_code)
                        break;
         case HTTP_404: response_str = "HTTP/1.0 404 Not Found\r\n";
                        break;
+        case HTTP_500: response_str = "HTTP/1.0 500 Internal Server Error\r\n";
+                       break;
     }
     write(clientfd, response_str, strlen(response_str));
     write(clientfd, "\r\n", 2);
 }
 
-/* Reads and scans HTTP header from clientfd and writes back at 'header' */
+/* Formats a framed response header into 'buf', which must hold
+ * MAX_RESPONSE_HEADER_LENGTH bytes. The Content-Length lets the client find
+ * the end of the response without the connection being closed.
+ * @return length of the header */
+int http_format_response_header(char* buf, int http_response_code,
+                                long content_length, int keep_alive)
+{
+    char* status_str;
+    switch (http_response_code)
+    {
+        case HTTP_200: status_str = "200 OK";
+                       break;
+        case HTTP_404: status_str = "404 Not Found";
+                       break;
+        case HTTP_500: status_str = "500 Internal Server Error";
+                       break;
+        case HTTP_503: status_str = "503 Service Unavailable";
+                       break;
+        default:       status_str = "500 Internal Server Error";
+                       break;
+    }
+    return snprintf(buf, MAX_RESPONSE_HEADER_LENGTH,
+                    "HTTP/1.1 %s\r\n"
+                    "Content-Length: %ld\r\n"
+                    "Connection: %s\r\n\r\n",
+                    status_str, content_length,
+                    keep_alive ? "keep-alive" : "close");
+}
+
+/* Replies for shedding load. They are built at compile time, so an
+ * overloaded server spends nothing on formatting them */
+#define HTTP_OVERLOAD_RESPONSE(connection) \
+        "HTTP/1.1 503 Service Unavailable\r\n" \
+        "Retry-After: " STRINGIFY(HTTP_RETRY_AFTER_SECONDS) "\r\n" \
+        "Content-Length: 0\r\n" \
+        "Connection: " connection "\r\n\r\n"
+
+static const char overload_keep_alive[] = HTTP_OVERLOAD_RESPONSE("keep-alive");
+static const char overload_close[] = HTTP_OVERLOAD_RESPONSE("close");
+
+/* @return the precomputed 503 reply, its length in 'length' */
+const char* http_overload_response(int keep_alive, size_t* length)
+{
+    if (keep_alive)
+    {
+        *length = sizeof(overload_keep_alive) - 1;
+        return overload_keep_alive;
+    }
+    *length = sizeof(overload_close) - 1;
+    return overload_close;
+}
+
+/* Decides if the connection stays open after the response.
+ * HTTP/1.1 connections are persistent unless the client asks to close.
+ * HTTP/1.0 connections are persistent only if the client asks for it. */
+int http_keep_alive(http_header_t* header)
+{
+    if (strcmp(header->request_http_version, "HTTP/1.1") == 0)
+        return strcasecmp(header->connection, "close") != 0;
+    return strcasecmp(header->connection, "keep-alive") == 0;
+}
+
+/* Scans the request line. Ex: GET / HTTP/1.1 */
+static int http_scan_request_line(char* line, http_header_t* header)
+{
+    if (sscanf(line, STR_FMTB(MAX_REQUEST_TYPE_LENGTH)" "
+                     STR_FMTB(MAX_URL_LENGTH)" "
+                     STR_FMTB(MAX_HTTP_VERSION_LENGTH),
+                header->request_type,
+                header->request_url,
+                header->request_http_version) != 3)
+    {
+        return HTTP_INVALID_REQUEST;
+    }
+
+    /* Error checking.
+     * Check the request type. Only GET is supported */
+    if (strcmp(header->request_type, "GET") != 0)
+    {
+        return HTTP_REQ_TYPE_NOT_SUPPORTED;
+    }
+
+    /* Check the HTTP Version, only 1.1 or 1.0 is supported */
+    if ( ! ((strcmp(header->request_http_version, "HTTP/1.0") == 0)
+         || strcmp(header->request_http_version, "HTTP/1.1") == 0))
+    {
+        return HTTP_VERSION_NOT_SUPPORTED;
+    }
+    return SUCCESS;
+}
+
+/* Scans a header line (key value pair) into the header structure.
+ * @return SUCCESS, HTTP_HEADER_END for the empty line ending the header or
+ * an error code */
+static int http_scan_header_line(char* line, http_header_t* header)
+{
+    header_kv_pair_t* hdr = (header_kv_pair_t*)
+                            Malloc(sizeof (header_kv_pair_t));
+    /* Assumption is that key and values don't exceed 200 chars */
+    int ret = sscanf(   line,
+                        STR_FMTB(MAX_HEADER_VALUE_LENGTH)
+                        " "STR_FMTB(MAX_HEADER_VALUE_LENGTH),
+                        hdr->key, hdr->value);
+    if (ret != 2)
+    {
+        /* Parse not success, free the header */
+        Free(hdr);
+        if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0)
+        {
+            return HTTP_HEADER_END;
+        }
+        printf("ERROR: Invalid header key values:%s:\n", line);
+        return HTTP_ERR_HEADER_KEY_VALUE_INVALID;
+    }
+
+    if (strcasecmp(hdr->key, "Host:")==0)
+    {
+        strncpy(header->host, hdr->value, MAX_HEADER_VALUE_LENGTH);
+    }
+    else if (strcasecmp(hdr->key, "User-Agent:")==0)
+    {
+        strncpy(header->user_agent, hdr->value, MAX_HEADER_VALUE_LENGTH);
+    }
+    else if (strcasecmp(hdr->key, "Connection:")==0)
+    {
+        strncpy(header->connection, hdr->value, MAX_HEADER_VALUE_LENGTH);
+    }
+    else if (strcasecmp(hdr->key, "Proxy-Connection:")==0)
+    {
+        strncpy(header->proxy_connection,
+                hdr->value, MAX_HEADER_VALUE_LENGTH);
+    }
+    else
+    {
+        add_new_header_item(header, hdr);
+        return SUCCESS;
+    }
+    /* If the header is not added to the list, free it.
+     * Some of the headers are not added to the list but instead
+     * directly stored in the structure such as user agent, connection
+     * host, proxy connection.*/
+    Free(hdr);
+    return SUCCESS;
+}
+
+/* Reads and scans HTTP header from clientfd and writes back at 'header'.
+ * Blocks until the whole header is read */
 int http_scan_header(int clientfd, http_header_t* header)
 {
     rio_t rio; /* For robust IO */
@@ -66,93 +215,90 @@ int http_scan_header(int clientfd, http_header_t* header)
     /* Scan the request header */
     if (rio_readlineb(&rio, temp_buffer, MAX_READLINE_STR_LENGTH) > 0)
     {
-        if (sscanf(temp_buffer, STR_FMTB(MAX_REQUEST_TYPE_LENGTH)" "
-                                STR_FMTB(MAX_URL_LENGTH)" "
-                                STR_FMTB(MAX_HTTP_VERSION_LENGTH),
-                    header->request_type,
-                    header->request_url,
-                    header->request_http_version) != 3)
-        {
-            return HTTP_INVALID_REQUEST;
-        }
-
-        /* Error checking.
-         * Check the request type. Only GET is supported */
-        if (strcmp(header->request_type, "GET") != 0)
-        {
-            return HTTP_REQ_TYPE_NOT_SUPPORTED;
-        }
-
-        /* Check the HTTP Version, only 1.1 or 1.0 is supported */
-        if ( ! ((strcmp(header->request_http_version, "HTTP/1.0") == 0)
-             || strcmp(header->request_http_version, "HTTP/1.1") == 0))
-        {
-            return HTTP_VERSION_NOT_SUPPORTED;
-        }
+        int ret = http_scan_request_line(temp_buffer, header);
+        if (ret != SUCCESS)
+            return ret;
         request_format_scanned = true;
     }
 
     /* Scan the headers */
     while (rio_readlineb(&rio, temp_buffer, MAX_READLINE_STR_LENGTH) > 0)
     {
-        header_kv_pair_t* hdr = (header_kv_pair_t*)
-                                Malloc(sizeof (header_kv_pair_t));
-        /* Assumption is that key and values don't exceed 200 chars */
-        int ret = sscanf(   temp_buffer,
-                            STR_FMTB(MAX_HEADER_VALUE_LENGTH)
-                            " "STR_FMTB(MAX_HEADER_VALUE_LENGTH),
-                            hdr->key, hdr->value);
-        if (ret == 2)
+        int ret = http_scan_header_line(temp_buffer, header);
+        if (ret != SUCCESS && ret != HTTP_HEADER_END)
+            return ret;
+        other_headers_scanned = true;
+        if (ret == HTTP_HEADER_END)
+            break;
+    }
+    if (!(request_format_scanned && other_headers_scanned))
+    {
+        return HTTP_INVALID_PROTOCOL;
+    }
+    return SUCCESS;
+}
+
+/* Resets the parser for a new request */
+void http_parser_init(http_parser_t* parser)
+{
+    parser->state = HTTP_PARSER_REQUEST_LINE;
+    parser->line_start = 0;
+    parser->scan_pos = 0;
+}
+
+/* Incremental request parser. Parses the complete lines in buf[0, length)
+ * which were not parsed by earlier calls, and never blocks. The caller keeps
+ * the bytes in 'buf' between calls and appends new input at the end.
+ * @return SUCCESS once the whole header is parsed, with 'consumed' set to
+ * the length of the request. Anything after it belongs to the next
+ * (pipelined) request.
+ * HTTP_PARSE_INCOMPLETE when more input is needed, or an error code. */
+int http_parse_request(http_parser_t* parser, http_header_t* header,
+                       const char* buf, size_t length, size_t* consumed)
+{
+    char line[MAX_READLINE_STR_LENGTH];
+    while (1)
+    {
+        const char* end = memchr(buf + parser->scan_pos, '\n',
+                                 length - parser->scan_pos);
+        if (end == NULL)
         {
-            if (strcmp(hdr->key, "Host:")==0)
-            {
-                strncpy(header->host, hdr->value, MAX_HEADER_VALUE_LENGTH);
-            }
-            else if (strcmp(hdr->key, "User-Agent:")==0)
-            {
-                strncpy(header->user_agent, hdr->value, MAX_HEADER_VALUE_LENGTH);
-            }
-            else if (strcmp(hdr->key, "Connection:")==0)
-            {
-                strncpy(header->connection, hdr->value, MAX_HEADER_VALUE_LENGTH);
-            }
-            else if (strcmp(hdr->key, "Proxy-Connection:")==0)
-            {
-                strncpy(header->proxy_connection,
-                        hdr->value, MAX_HEADER_VALUE_LENGTH);
-            }
-            else
-            {
-                add_new_header_item(header, hdr);
-                other_headers_scanned = true;
+            /* Don't look at these bytes again on the next call */
+            parser->scan_pos = length;
+            if (length - parser->line_start >= MAX_READLINE_STR_LENGTH)
+                return HTTP_INVALID_REQUEST;
+            return HTTP_PARSE_INCOMPLETE;
+        }
+        size_t line_length = end - (buf + parser->line_start) + 1;
+        if (line_length >= MAX_READLINE_STR_LENGTH)
+            return HTTP_INVALID_REQUEST;
+        memcpy(line, buf + parser->line_start, line_length);
+        line[line_length] = '\0';
+        parser->line_start += line_length;
+        parser->scan_pos = parser->line_start;
+
+        int ret;
+        if (parser->state == HTTP_PARSER_REQUEST_LINE)
+        {
+            /* Empty lines before the request line are ignored */
+            if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0)
                 continue;
-            }
-            /* If the header is not added to the list, free it.
-             * Some of the headers are not added to the list but instead
-             * directly stored in the structure such as user agent, connection
-             * host, proxy connection.*/
-            Free(hdr);
-            other_headers_scanned = true;
+            ret = http_scan_request_line(line, header);
+            if (ret != SUCCESS)
+                return ret;
+            parser->state = HTTP_PARSER_HEADERS;
         }
         else
         {
-            /* Parse not success, free the header */
-            Free(hdr);
-            if (strcmp(temp_buffer, "\r\n") == 0)
-            {
-                other_headers_scanned = true;
-                break;
-            }
-            else
+            ret = http_scan_header_line(line, header);
+            if (ret == HTTP_HEADER_END)
             {
-                printf("ERROR: Invalid header key values:%s:\n", temp_buffer);
-                return HTTP_ERR_HEADER_KEY_VALUE_INVALID;
+                *consumed = parser->line_start;
+                http_parser_init(parser);
+                return SUCCESS;
             }
+            if (ret != SUCCESS)
+                return ret;
         }
     }
-    if (!(request_format_scanned && other_headers_scanned))
-    {
-        return HTTP_INVALID_PROTOCOL;
-    }
-    return SUCCESS;
 }
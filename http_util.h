@@ -1,6 +1,8 @@
 #ifndef __HTTP_PROTO_H
 #define __HTTP_PROTO_H
 #include "http_header.h"
+#include "csapp.h"
+#include <stddef.h>
 
 #define RESOURCE_TYPE_CGI_BIN   1
 #define RESOURCE_TYPE_HTML      2
@@ -12,8 +14,35 @@
 /* Response codes */
 #define HTTP_200                10
 #define HTTP_404                11
+#define HTTP_503                12
+#define HTTP_500                13
+
+#define HTTP_RETRY_AFTER_SECONDS    1 /* Retry-After of the replies sent
+                                         while shedding load */
+
+#define MAX_RESPONSE_HEADER_LENGTH  256
+
+/* Incremental parser states */
+#define HTTP_PARSER_REQUEST_LINE    1
+#define HTTP_PARSER_HEADERS         2
+
+/* State of a request header being parsed as its bytes trickle in. Offsets
+ * are relative to the start of the caller's buffer */
+typedef struct http_parser
+{
+    int state;
+    size_t line_start; /* Start of the line being parsed */
+    size_t scan_pos; /* Bytes up to here have no end of line */
+}http_parser_t;
 
 int http_scan_header(int clientfd, http_header_t* header);
+void http_parser_init(http_parser_t* parser);
+int http_parse_request(http_parser_t* parser, http_header_t* header,
+                       const char* buf, size_t length, size_t* consumed);
+int http_keep_alive(http_header_t* header);
 int http_write_response_header(int clientfd, int http_response_code);
+int http_format_response_header(char* buf, int http_response_code,
+                                long content_length, int keep_alive);
+const char* http_overload_response(int keep_alive, size_t* length);
 int get_resource_type(char* url, char* resource_name);
 #endif
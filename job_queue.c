@@ -0,0 +1,131 @@
+/* Bounded lock-free job queue.
+ * ****************************
+ * A fixed size ring of slots, each carrying a sequence number. A producer
+ * claims a slot by advancing 'enqueue_pos' with a CAS and publishes the item
+ * by bumping the slot's sequence. Consumers do the same on 'dequeue_pos'.
+ * No locks are taken on either side, so the event loop never waits for a
+ * worker to hand off a request. Waking up idle consumers is left to the
+ * caller.
+ */
+#include "job_queue.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+/* job_queue_create
+ * Creates a queue which can hold 'capacity' items. Capacity is rounded up
+ * to the next power of two.
+ * @return new queue's address.
+ */
+job_queue_t* job_queue_create(size_t capacity)
+{
+    size_t size = 4;
+    while (size < capacity)
+        size <<= 1;
+
+    job_queue_t* queue = aligned_alloc(CACHE_LINE_SIZE, sizeof(job_queue_t));
+    if (queue == NULL || (queue->slots = aligned_alloc(CACHE_LINE_SIZE,
+                                size * sizeof(job_queue_slot_t))) == NULL)
+    {
+        perror("Cannot allocate the job queue");
+        exit(EXIT_FAILURE);
+    }
+    size_t i;
+    for (i = 0; i < size; i++)
+    {
+        atomic_init(&queue->slots[i].seq, i);
+        queue->slots[i].data = NULL;
+    }
+    queue->mask = size - 1;
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    return queue;
+}
+
+void job_queue_destroy(job_queue_t* queue)
+{
+    free(queue->slots);
+    free(queue);
+}
+
+/* Adds an item at the tail of the queue.
+ * @return JOB_QUEUE_SUCCESS or JOB_QUEUE_FULL */
+int job_queue_push(job_queue_t* queue, void* data)
+{
+    job_queue_slot_t* slot;
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos,
+                                      memory_order_relaxed);
+    while (1)
+    {
+        slot = &queue->slots[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long diff = (long)seq - (long)pos;
+        if (diff == 0)
+        {
+            /* Slot is free. Try to claim it */
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos,
+                        &pos, pos + 1, memory_order_relaxed,
+                        memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            /* Consumers haven't freed this slot yet */
+            return JOB_QUEUE_FULL;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->enqueue_pos,
+                                       memory_order_relaxed);
+        }
+    }
+    slot->data = data;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return JOB_QUEUE_SUCCESS;
+}
+
+/* Removes an item from the head of the queue.
+ * @return item or NULL if the queue is empty */
+void* job_queue_pop(job_queue_t* queue)
+{
+    job_queue_slot_t* slot;
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos,
+                                      memory_order_relaxed);
+    while (1)
+    {
+        slot = &queue->slots[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long diff = (long)seq - (long)(pos + 1);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos,
+                        &pos, pos + 1, memory_order_relaxed,
+                        memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            /* Nothing published in this slot yet */
+            return NULL;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->dequeue_pos,
+                                       memory_order_relaxed);
+        }
+    }
+    void* data = slot->data;
+    /* Hand the slot back to the producers for the next lap */
+    atomic_store_explicit(&slot->seq, pos + queue->mask + 1,
+                          memory_order_release);
+    return data;
+}
+
+size_t job_queue_length(job_queue_t* queue)
+{
+    size_t tail = atomic_load_explicit(&queue->enqueue_pos,
+                                       memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->dequeue_pos,
+                                       memory_order_relaxed);
+    /* The head is read last and may have moved past the tail read before */
+    return tail > head ? tail - head : 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * Header file for the bounded multi-producer/multi-consumer job queue.
+ * Used to hand requests from the event loop to the worker threads and to
+ * hand the finished requests back.
+ */
+#ifndef __JOB_QUEUE_H
+#define __JOB_QUEUE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE_SIZE         64
+#define JOB_QUEUE_SUCCESS       0
+#define JOB_QUEUE_FULL          -1
+
+/* One slot of the ring. 'seq' tells producers and consumers whose turn it
+ * is to use the slot (Vyukov's bounded MPMC queue) */
+typedef struct job_queue_slot
+{
+    atomic_size_t seq;
+    void* data;
+}job_queue_slot_t;
+
+/* Producer and consumer positions live on separate cache lines so that
+ * the event loop and the workers don't bounce the same line */
+typedef struct job_queue
+{
+    job_queue_slot_t* slots;
+    size_t mask; /* Capacity - 1. Capacity is a power of two */
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t dequeue_pos;
+}job_queue_t;
+
+/* Create and destroy */
+job_queue_t* job_queue_create(size_t capacity);
+void job_queue_destroy(job_queue_t* queue);
+
+/* Push never blocks. Returns JOB_QUEUE_FULL when the ring is full */
+int job_queue_push(job_queue_t* queue, void* data);
+/* Pop returns NULL when the queue is empty */
+void* job_queue_pop(job_queue_t* queue);
+/* Number of items waiting. Approximate while others push or pop */
+size_t job_queue_length(job_queue_t* queue);
+#endif /* __JOB_QUEUE_H */
@@ -0,0 +1,108 @@
+/* Fixed size object pool.
+ * ***********************
+ * Objects are carved out of cache line aligned slabs. Every object starts
+ * on a cache line boundary, so two connections never share a line. Free
+ * objects are chained through their first word, making alloc and free a
+ * pointer swap. Slabs are never given back to the system; a pool only grows
+ * to the peak number of objects its reactor had in use.
+ */
+#include "mem_pool.h"
+#include "job_queue.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+/* Every slab starts with a header linking it to the previous slab. The
+ * header takes a full cache line so that the objects stay aligned */
+typedef struct mem_pool_slab
+{
+    struct mem_pool_slab* next;
+}mem_pool_slab_t;
+
+static void add_slab(mem_pool_t* pool)
+{
+    char* slab = aligned_alloc(CACHE_LINE_SIZE, CACHE_LINE_SIZE +
+                               pool->object_size * pool->slab_objects);
+    if (slab == NULL)
+    {
+        perror("Cannot allocate a pool slab");
+        exit(EXIT_FAILURE);
+    }
+    ((mem_pool_slab_t*)slab)->next = pool->slabs;
+    pool->slabs = slab;
+
+    /* Chain the new objects in address order onto the free list */
+    char* object = slab + CACHE_LINE_SIZE;
+    size_t i;
+    for (i = 0; i < pool->slab_objects; i++)
+    {
+        *(void**)object = (i + 1 < pool->slab_objects) ?
+                                object + pool->object_size : pool->free_list;
+        object += pool->object_size;
+    }
+    pool->free_list = slab + CACHE_LINE_SIZE;
+    atomic_store_explicit(&pool->capacity, atomic_load_explicit(
+                &pool->capacity, memory_order_relaxed) + pool->slab_objects,
+                memory_order_relaxed);
+}
+
+/* mem_pool_init
+ * Sets up a pool of objects of 'object_size' bytes, growing
+ * 'slab_objects' objects at a time. The first slab is allocated right away.
+ */
+void mem_pool_init(mem_pool_t* pool, size_t object_size, size_t slab_objects)
+{
+    if (object_size < sizeof(void*))
+        object_size = sizeof(void*);
+    pool->object_size = (object_size + CACHE_LINE_SIZE - 1) &
+                                            ~(size_t)(CACHE_LINE_SIZE - 1);
+    pool->slab_objects = slab_objects > 0 ? slab_objects : 1;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    atomic_init(&pool->in_use, 0);
+    atomic_init(&pool->capacity, 0);
+    add_slab(pool);
+}
+
+void mem_pool_destroy(mem_pool_t* pool)
+{
+    mem_pool_slab_t* slab = pool->slabs;
+    while (slab)
+    {
+        mem_pool_slab_t* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+}
+
+/* @return an uninitialized object. Never fails */
+void* mem_pool_alloc(mem_pool_t* pool)
+{
+    if (pool->free_list == NULL)
+        add_slab(pool);
+    void* object = pool->free_list;
+    pool->free_list = *(void**)object;
+    /* Single writer, so a plain load and store is enough */
+    atomic_store_explicit(&pool->in_use, atomic_load_explicit(&pool->in_use,
+                          memory_order_relaxed) + 1, memory_order_relaxed);
+    return object;
+}
+
+void mem_pool_free(mem_pool_t* pool, void* object)
+{
+    *(void**)object = pool->free_list;
+    pool->free_list = object;
+    atomic_store_explicit(&pool->in_use, atomic_load_explicit(&pool->in_use,
+                          memory_order_relaxed) - 1, memory_order_relaxed);
+}
+
+size_t mem_pool_in_use(mem_pool_t* pool)
+{
+    return atomic_load_explicit(&pool->in_use, memory_order_relaxed);
+}
+
+size_t mem_pool_capacity(mem_pool_t* pool)
+{
+    return atomic_load_explicit(&pool->capacity, memory_order_relaxed);
+}
@@ -0,0 +1,35 @@
+/*
+ * Header file for the fixed size object pool.
+ * Every reactor owns a pool for its connection states and one for its
+ * request items, so accepting a connection or dispatching a request doesn't
+ * go through malloc's arena locks.
+ */
+#ifndef __MEM_POOL_H
+#define __MEM_POOL_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* A pool hands out objects of one size. Objects are carved out of slabs of
+ * 'slab_objects' objects and recycled through an intrusive free list. A
+ * pool is owned by a single thread, which does all the allocs and frees.
+ * 'in_use' and 'capacity' are only written by that thread; the statistics
+ * thread reads them */
+typedef struct mem_pool
+{
+    size_t object_size; /* Rounded up to a multiple of CACHE_LINE_SIZE */
+    size_t slab_objects;
+    void* free_list;
+    void* slabs; /* Slabs allocated so far. Kept until the pool dies */
+    atomic_size_t in_use;
+    atomic_size_t capacity;
+}mem_pool_t;
+
+void mem_pool_init(mem_pool_t* pool, size_t object_size, size_t slab_objects);
+void mem_pool_destroy(mem_pool_t* pool);
+/* O(1) unless the pool has to grow by a slab */
+void* mem_pool_alloc(mem_pool_t* pool);
+void mem_pool_free(mem_pool_t* pool, void* object);
+size_t mem_pool_in_use(mem_pool_t* pool);
+size_t mem_pool_capacity(mem_pool_t* pool);
+#endif /* __MEM_POOL_H */
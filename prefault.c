@@ -0,0 +1,70 @@
+/* Prefaulting of loaded modules.
+ * *****************************
+ * Finds the executable segments of a loaded library and populates their
+ * page tables. Kept apart from the rest of the server as finding the
+ * segments needs glibc's GNU extensions, and _GNU_SOURCE clashes with
+ * csapp.h.
+ */
+#define _GNU_SOURCE
+#include "prefault.h"
+#include <dlfcn.h>
+#include <link.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+typedef struct prefault_target
+{
+    struct link_map* map;
+    size_t pages;
+}prefault_target_t;
+
+static void prefault_range(char* start, size_t length, size_t page_size)
+{
+#ifdef MADV_POPULATE_READ
+    if (madvise(start, length, MADV_POPULATE_READ) == 0)
+        return;
+#endif
+    /* Older kernel. Touch every page */
+    volatile char sink;
+    size_t offset;
+    for (offset = 0; offset < length; offset += page_size)
+        sink = start[offset];
+    (void)sink;
+}
+
+static int prefault_segments(struct dl_phdr_info* info, size_t size,
+                             void* arg)
+{
+    prefault_target_t* target = (prefault_target_t*)arg;
+    (void)size; /* Of 'info', required by dl_iterate_phdr */
+    if (info->dlpi_addr != target->map->l_addr ||
+        strcmp(info->dlpi_name, target->map->l_name) != 0)
+        return 0;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    int i;
+    for (i = 0; i < info->dlpi_phnum; i++)
+    {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X))
+            continue;
+        uintptr_t start = (info->dlpi_addr + phdr->p_vaddr) &
+                                                    ~(page_size - 1);
+        uintptr_t end = (info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz +
+                         page_size - 1) & ~(page_size - 1);
+        prefault_range((char*)start, end - start, page_size);
+        target->pages += (end - start) / page_size;
+    }
+    return 1; /* Found, stop */
+}
+
+size_t prefault_library(void* handle)
+{
+    prefault_target_t target;
+    target.pages = 0;
+    if (dlinfo(handle, RTLD_DI_LINKMAP, &target.map) == -1)
+        return 0;
+    dl_iterate_phdr(prefault_segments, &target);
+    return target.pages;
+}
@@ -0,0 +1,14 @@
+/*
+ * Header file for prefaulting loaded modules.
+ * The first requests for a module otherwise take a page fault for every
+ * page of its code they touch.
+ */
+#ifndef __PREFAULT_H
+#define __PREFAULT_H
+
+#include <stddef.h>
+
+/* Maps in the code pages of the library behind a dlopen handle.
+ * @return number of pages prefaulted */
+size_t prefault_library(void* handle);
+#endif /* __PREFAULT_H */
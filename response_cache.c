@@ -0,0 +1,131 @@
+/* Dynamic response cache.
+ * ***********************
+ * A module opts in by exporting RESPONSE_TTL_SYMBOL. A worker which ran it
+ * successfully keeps a copy of the output, keyed by the URL under /cgi-bin/
+ * and stamped with its expiry. Until then, the reactors answer requests for
+ * that URL on their own: they frame the cached body with a fresh header and
+ * queue both, so the response goes out with a single writev.
+ *
+ * The entries live in a cache of their own, sharded, bounded by
+ * RESPONSE_CACHE_SIZE and with lock free lookups like the module cache.
+ * Bodies are reference counted, so a body evicted or replaced while
+ * connections are still sending it is freed by the last of them. A stale
+ * entry is left in place and replaced by the next worker which runs the
+ * module.
+ */
+#include "response_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include "csapp.h"
+#include "cache.h"
+
+static cache_t* response_cache;
+static atomic_long expired_lookups; /* Found, but too old to be sent */
+
+void init_response_cache(int policy)
+{
+    response_cache = get_new_cache(RESPONSE_CACHE_SIZE, policy,
+                                   CACHE_DEFAULT_SHARDS);
+}
+
+static void release_cached_response(cached_response_t* response)
+{
+    if (atomic_fetch_sub_explicit(&response->refs, 1,
+                                  memory_order_acq_rel) == 1)
+        Free(response);
+}
+
+void release_cached_response_body(char* body)
+{
+    release_cached_response((cached_response_t*)(body -
+                                    offsetof(cached_response_t, body)));
+}
+
+/* Called once no reader can find the entry anymore */
+static void response_eviction_callback(cache_data_item_t* item)
+{
+    release_cached_response((cached_response_t*)item->value.value_data);
+}
+
+cached_response_t* lookup_cached_response(char* url, uint64_t now_ms)
+{
+    cache_key_t key;
+    init_cache_key(&key, url);
+    cached_response_t* response = NULL;
+    cache_read_begin();
+    cache_entry_t* entry = get_cached_item(response_cache, &key);
+    if (entry != NULL)
+    {
+        response = (cached_response_t*)entry->data->value.value_data;
+        if (response->expires_ms > now_ms)
+        {
+            /* The cache's own reference can't go while we are in the read
+             * section */
+            atomic_fetch_add_explicit(&response->refs, 1,
+                                      memory_order_relaxed);
+        }
+        else
+        {
+            atomic_fetch_add_explicit(&expired_lookups, 1,
+                                      memory_order_relaxed);
+            response = NULL;
+        }
+    }
+    cache_read_end();
+    return response;
+}
+
+void store_cached_response(char* url, int fd, size_t length, int ttl_ms)
+{
+    cached_response_t* response = Malloc(sizeof(cached_response_t) + length);
+    if (length > 0 && pread(fd, response->body, length, 0) != (ssize_t)length)
+    {
+        perror("pread response to cache");
+        Free(response);
+        return;
+    }
+    atomic_init(&response->refs, 1);
+    response->length = length;
+    response->expires_ms = monotonic_ms() + ttl_ms;
+
+    cache_key_t key;
+    init_cache_key(&key, url);
+    cache_entry_t* entry = get_new_cache_entry();
+    entry->data = Malloc(sizeof(cache_data_item_t));
+    memset(entry->data, 0, sizeof(cache_data_item_t));
+    copy_cache_key(&entry->data->key, &key);
+    entry->data->value.value_data = response;
+    entry->delete_callback = response_eviction_callback;
+    entry->data_size = length;
+
+    get_cache_shard_wrlock(response_cache, &key);
+    cache_entry_t* current = peek_cached_item(response_cache, &key);
+    if (current != NULL)
+    {
+        replace_cache_entry(response_cache, current, entry);
+        entry = NULL;
+    }
+    else if (add_to_cache(response_cache, entry) != CACHE_INSERT_ERR)
+    {
+        entry = NULL;
+    }
+    release_cache_shard_wrlock(response_cache, &key);
+    if (entry != NULL)
+    {
+        /* Larger than a shard */
+        response_eviction_callback(entry->data);
+        free_cache_entry(entry);
+    }
+}
+
+/* Expired entries count as misses */
+void get_response_cache_stats(cache_stats_t* stats)
+{
+    get_cache_stats(response_cache, stats);
+    long expired = atomic_load_explicit(&expired_lookups,
+                                        memory_order_relaxed);
+    stats->hits -= expired;
+    stats->misses += expired;
+}
@@ -0,0 +1,39 @@
+/*
+ * Header file for the dynamic response cache.
+ * Modules whose output stays the same for a while declare how long, and
+ * their responses are then served by the reactors straight from memory
+ * until they expire, without going through a worker.
+ */
+#ifndef __RESPONSE_CACHE_H
+#define __RESPONSE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "cache.h"
+
+#define RESPONSE_CACHE_SIZE     (4 * 1024 * 1024) /* Bytes of bodies */
+#define RESPONSE_TTL_SYMBOL     "cgi_cache_ttl_ms" /* int exported by a
+                                   module whose responses may be reused for
+                                   that many milliseconds */
+
+/* Body of a module's response, shared by the cache and the connections
+ * sending it. Never changed once cached */
+typedef struct cached_response
+{
+    atomic_int refs; /* The cache's, and one per queued copy */
+    uint64_t expires_ms; /* monotonic_ms() after which it is stale */
+    size_t length;
+    char body[];
+}cached_response_t;
+
+void init_response_cache(int policy);
+/* @return the fresh response for 'url' with a reference taken, or NULL */
+cached_response_t* lookup_cached_response(char* url, uint64_t now_ms);
+/* Caches the 'length' bytes of 'fd' as the response for 'url' */
+void store_cached_response(char* url, int fd, size_t length, int ttl_ms);
+/* Drops a reference. Takes the body, so it can be an output release
+ * callback */
+void release_cached_response_body(char* body);
+void get_response_cache_stats(cache_stats_t* stats);
+#endif /* __RESPONSE_CACHE_H */
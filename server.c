@@ -1,17 +1,28 @@
 /*
- * HTTP/1.0 compliant high performance dynamic content server.
+ * HTTP/1.1 compliant high performance dynamic content server.
  *
  * Features
  * ********
- * 1. Implements HTTP/1.0 GET requests for static and dynamic content.
- * 2. Assumes one connection per request (no persistent connections).
+ * 1. Implements HTTP/1.0 and HTTP/1.1 GET requests for static and dynamic
+ *    content.
+ * 2. Supports persistent connections and pipelined requests. Responses are
+ *    framed with Content-Length.
  * 3. Uses worker threads with dynamic loading of (.so) to achieve faster dynamic
 	content generation. Only ELF compatible modules are supported.
  * 4. Serves HTML (.html), image (.gif and .jpg), and text (.txt) files.
- * 5. Accepts a single command-line argument: the port to listen on.
- * 6. Implements concurrency using IO Multiplexing and worker threads.
- * 7. Does code caching to perform fast dynamic code execution.
- * 8. Automates cache code revalidation every 1 minute (can be confgigurable).
+ * 5. Accepts the port to listen on, an optional number of reactors (-r) and
+ *    the direct dispatch mode (-d), where workers write dynamic responses to
+ *    the client themselves instead of relaying them through the reactor.
+ * 6. Implements concurrency using IO Multiplexing and worker threads. Each
+ *    reactor thread runs its own event loop on its own SO_REUSEPORT listening
+ *    socket, either on epoll or on io_uring (-u).
+ * 7. Does code caching to perform fast dynamic code execution. With -p, all
+ *    modules are loaded, bound and paged in before the server listens.
+ *    Evicts with CLOCK, or with W-TinyLFU admission (-e tinylfu).
+ *    Responses of modules declaring a TTL are served from memory by the
+ *    reactors until they expire. With -g, identical dynamic requests in
+ *    flight share a single run of the module.
+ * 8. Reloads cached code as soon as its module is replaced (inotify).
  	  Once loaded, the code can change in the file system. Reloading is done
 	  automatically.
  * 9. Supports dynamic plug and play .so modules. (Install the modules at
@@ -32,6 +43,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
@@ -39,6 +51,8 @@
 #include "http_header.h"
 #include "http_util.h"
 #include "util.h"
+#include "cache.h"
+#include "response_cache.h"
 #include <sys/epoll.h>
 #include "csapp.h"
 #include <dlfcn.h>
@@ -51,14 +65,32 @@
                                               be delivered. Set this to around
                                               max connections that can be
                                               outstanding in the server */
-#define WORKER_THREAD_COUNT         3       /* Tune this parameter according
-                                               to number of cores in your
-                                               system */
+#define DEFAULT_MIN_WORKERS         0       /* Dynamic content workers kept
+                                               at all times, 0 for one per
+                                               core. Override with -w */
+#define DEFAULT_MAX_WORKERS         0       /* Ceiling the pool grows to, 0
+                                               for MAX_WORKERS_PER_CORE per
+                                               core. Override with -W */
+#define DEFAULT_SLOW_WORKERS        0       /* Workers kept by the slow
+                                               lane, 0 for one per
+                                               SLOW_LANE_CORE_SHARE cores.
+                                               Override with -s */
+#define MAX_WORKERS_PER_CORE        4       /* Leaves room for modules which
+                                               block */
+#define DEFAULT_REACTOR_COUNT       1       /* Event loop threads. Override
+                                               with -r */
+#define DEFAULT_MAX_CONNECTIONS     50000   /* Clients served at once.
+                                               Override with -c */
+#define DEFAULT_MAX_QUEUED_JOBS     1024    /* Dynamic requests waiting for
+                                               a worker before new ones are
+                                               shed. Override with -q */
+static server_config_t config;
+
 /*
  * This is a thread function to serve static content like images, text, html.
  * Upon a request for static content, a thread is spawned with this function
  * to server the request. It uses sendfile to avoid overhead of kernel->user
- * copying. */
+ * copying. The connection is handed back to its reactor when done. */
 void* static_content_worker_thread(void* arg)
 {
     request_item* item = (request_item*)arg;
@@ -69,104 +101,469 @@ void* static_content_worker_thread(void* arg)
         perror("Thread cannot be detached");
         return (void*)-1;
     }
-    handle_static(item->client_fd, item->resource_name);
-    increment_reply_count();
-    Close(item->client_fd);
-    free(item);
+    if (handle_static_request(item) == -1)
+        item->keep_alive = 0; /* Connection is broken */
+    send_completion_to_master(item);
     return 0;
 }
 
-/* This is a client request handler.
- * @param epollfd IO multiplexed fd.
- * @param con connection state of the client's connection in epoll.
- * */
-void handle_client_request(int epollfd, epoll_conn_state* con)
+/* Removes the client's connection from the reactor and closes it. The
+ * state is freed once the current batch of events is handled, as the batch
+ * may still hold events for it */
+void close_client_connection(reactor_t* reactor, epoll_conn_state* con)
+{
+    timer_wheel_cancel(&reactor->timers, &con->timer);
+    if (con->deferred != NULL)
+        free_request_item(con->deferred);
+    con->deferred = NULL;
+    if (reactor->backend == EVENT_BACKEND_URING)
+    {
+        /* Freed once the ring has no operation on it left */
+        uring_close_client(reactor, con);
+        return;
+    }
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, con->client_fd, NULL);
+    Close(con->client_fd);
+    free_client_output(con);
+    con->closed = 1;
+    con->next_closed = reactor->closed_head;
+    reactor->closed_head = con;
+}
+
+/* Closes the client's connection, unless a worker still holds its request.
+ * Such a connection is only cut off, and its state goes once the worker is
+ * done with it */
+void drop_client_connection(reactor_t* reactor, epoll_conn_state* con)
+{
+    if (con->busy && con->deferred == NULL)
+    {
+        shutdown(con->client_fd, SHUT_RDWR);
+        con->hangup = 1;
+    }
+    else
+    {
+        close_client_connection(reactor, con);
+    }
+}
+
+/* Frees the connections closed while handling the last batch of events */
+void free_closed_connections(reactor_t* reactor)
+{
+    while (reactor->closed_head != NULL)
+    {
+        epoll_conn_state* con = reactor->closed_head;
+        reactor->closed_head = con->next_closed;
+        free_client_connection(reactor, con);
+    }
+}
+
+/* Starts writing the connection's queued output. The epoll backend writes
+ * what the socket takes right away, the io_uring backend submits a send.
+ * @return -1 if the connection failed */
+int write_client_output(reactor_t* reactor, epoll_conn_state* con)
+{
+    if (reactor->backend == EVENT_BACKEND_URING)
+    {
+        uring_submit_client_output(reactor, con);
+        return 0;
+    }
+    return flush_client_output(con);
+}
+
+/* Hands a request over to a worker or a static thread. Those write to the
+ * client's socket themselves (static files and direct dispatch), so they
+ * are held back until the output queued before them went out.
+ * @return -1 if the workers are backed up */
+int dispatch_request(epoll_conn_state* con, request_item* reqitem)
 {
-    /* Scan the header */
-    http_header_t header;
-    init_header(&header);
-    http_scan_header(con->client_fd, &header);
+    con->busy = 1;
+    if ((reqitem->resource_type != RESOURCE_TYPE_CGI_BIN || reqitem->direct)
+        && con->out_head != NULL)
+    {
+        con->deferred = reqitem;
+        return 0;
+    }
+    if (reqitem->resource_type != RESOURCE_TYPE_CGI_BIN)
+    {
+        create_static_worker(reqitem, static_content_worker_thread);
+        return 0;
+    }
+    /* Dynamic requests are handled by worker threads. The client's
+     * connection waits for the completion. In direct mode, the worker owns
+     * the client's socket until then */
+    if (send_to_worker_thread(reqitem) == -1)
+    {
+        free_request_item(reqitem);
+        con->busy = 0;
+        return -1;
+    }
+    return 0;
+}
 
+/* Hands the parsed request over to a worker. Requests for unknown
+ * resources, and dynamic requests while the workers are overloaded, are
+ * answered right away.
+ * @return -1 if the connection has to be closed */
+int serve_request(reactor_t* reactor, epoll_conn_state* con,
+                  http_header_t* header)
+{
+    int keep_alive = http_keep_alive(header);
     request_item* reqitem;
     char resource_name[MAX_RESOURCE_NAME_LENGTH]; /* ex: cmu.jpg, etc */
+    char* response;
+    cached_response_t* cached;
+    request_item* leader;
+    const char* overload_response;
+    size_t length;
 
-    switch (get_resource_type(header.request_url, resource_name))
+    increment_request_count(); /* For stats */
+    int resource_type = get_resource_type(header->request_url, resource_name);
+    switch (resource_type)
     {
         case RESOURCE_TYPE_CGI_BIN:
-                    reqitem = create_dynamic_request_item(resource_name);
-                    /* Dynamic requests are handled by worker threads */
-                    int worker_fd = send_to_worker_thread(reqitem);
-                    Free(reqitem);
-                    if (worker_fd == -1)
+                    cached = lookup_cached_response(resource_name,
+                                                    reactor->now_ms);
+                    if (cached != NULL)
+                    {
+                        /* Served from memory, the module isn't run */
+                        response = Malloc(MAX_RESPONSE_HEADER_LENGTH);
+                        queue_client_output(con, response,
+                                http_format_response_header(response,
+                                        HTTP_200, cached->length,
+                                        keep_alive));
+                        queue_client_shared_output(con, cached->body,
+                                cached->length, release_cached_response_body);
+                        con->close_after_flush = !keep_alive;
+                        increment_reply_count();
+                        return 0;
+                    }
+                    leader = config.coalesce ?
+                             find_inflight_request(reactor, resource_name) :
+                             NULL;
+                    if (leader != NULL)
+                    {
+                        /* The same request is being run. Wait for its
+                         * response instead of running the module again */
+                        reqitem = create_dynamic_request_item(reactor,
+                                                             resource_name);
+                        reqitem->con = con;
+                        reqitem->resource_type = resource_type;
+                        reqitem->keep_alive = keep_alive;
+                        reqitem->next = leader->followers;
+                        leader->followers = reqitem;
+                        con->busy = 1;
+                        increment_coalesced_count();
+                        return 0;
+                    }
+                    if (!admit_dynamic_request())
                     {
-                        /* Close client's connection. */
-                        close(con->client_fd);
-                        break;
+                        /* Shed it. The client retries after a while */
+                        overload_response = http_overload_response(keep_alive,
+                                                                   &length);
+                        queue_client_static_output(con, overload_response,
+                                                   length);
+                        con->close_after_flush = !keep_alive;
+                        increment_reply_count();
+                        return 0;
                     }
-                    /* Store the assigned worker to the client connection's
-                     * epoll state */
-                    con->worker_fd = worker_fd;
-                    make_socket_non_blocking(worker_fd);
-                    add_worker_fd_to_epoll(epollfd, worker_fd, con);
+                    reqitem = create_dynamic_request_item(reactor,
+                                                         resource_name);
+                    reqitem->client_fd = con->client_fd;
+                    /* A coalesced response goes to every client through
+                     * the reactor, so it can't be written by the worker */
+                    reqitem->direct =
+                            (config.dispatch_mode == DISPATCH_MODE_DIRECT &&
+                             !config.coalesce);
                     break;
         case RESOURCE_TYPE_UNKNOWN:
-                    dbg_printf("Unknown %s\n", header.request_url);
-                    break;
+                    dbg_printf("Unknown %s\n", header->request_url);
+                    response = Malloc(MAX_RESPONSE_HEADER_LENGTH);
+                    queue_client_output(con, response,
+                            http_format_response_header(response, HTTP_404,
+                                                        0, keep_alive));
+                    con->close_after_flush = !keep_alive;
+                    increment_reply_count();
+                    return 0;
         default:    /* Handle static
                      * A worker is created for this request */
-                    create_static_worker(con->client_fd,
-                                        static_content_worker_thread,
-                                        resource_name);
-                    Free(con);
+                    reqitem = create_static_request_item(reactor,
+                                            resource_name, con->client_fd);
                     break;
     }
-    /* Free the header */
-    free_kvpairs_in_header(&header);
+    reqitem->con = con;
+    reqitem->resource_type = resource_type;
+    reqitem->keep_alive = keep_alive;
+    if (dispatch_request(con, reqitem) == -1)
+        return -1;
+    /* Identical requests join this one until it completes */
+    if (config.coalesce && resource_type == RESOURCE_TYPE_CGI_BIN)
+        track_inflight_request(reactor, reqitem);
+    return 0;
 }
 
-/*
- * Handle the response from the worker thread and send it back to the client.
- * It is invoked for dynamic requests after the worker thread finishes
- * generating the dynamic content */
-int handle_client_response(int epollfd, epoll_conn_state* con)
+/* Parses the next request out of the connection's input buffer, reading
+ * more from the socket if needed. Never blocks: a partial request leaves
+ * its parse state in the connection and is resumed on the next EPOLLIN.
+ * @return SUCCESS once a request is served, HTTP_PARSE_INCOMPLETE when
+ * waiting for input, or -1 if the connection has to be closed */
+int serve_next_request(reactor_t* reactor, epoll_conn_state* con)
 {
-    /* read the generated content and write back to the client */
-    char buf[MAX_READ_LENGTH];
-    int read_count = 0;
-    while ((read_count = read(con->worker_fd, buf, MAX_READ_LENGTH)) > 0)
+    size_t consumed;
+    int ret;
+    while (1)
     {
-        int a = rio_writen(con->client_fd, buf, read_count);
-        if (a == -1)
+        ret = http_parse_request(&con->parser, &con->header, con->in_buf,
+                                 con->in_length, &consumed);
+        if (ret != HTTP_PARSE_INCOMPLETE)
+            break;
+        if (con->read_eof)
+            return -1; /* Client is gone halfway through a request */
+        if (con->in_length == MAX_REQUEST_BUFFER_LENGTH)
+            return -1; /* Header doesn't fit in the buffer */
+        if (!con->read_pending)
+            return HTTP_PARSE_INCOMPLETE;
+        if (read_client_input(con) == -1)
             return -1;
     }
-    if (read_count == -1 && errno != EAGAIN)
+    if (ret != SUCCESS)
+    {
+        /* Malformed request. Drop what was parsed of it */
+        free_kvpairs_in_header(&con->header);
+        init_header(&con->header);
+        return -1;
+    }
+
+    ret = serve_request(reactor, con, &con->header);
+    /* Free the header and move the pipelined requests to the front */
+    free_kvpairs_in_header(&con->header);
+    init_header(&con->header);
+    con->in_length -= consumed;
+    memmove(con->in_buf, con->in_buf + consumed, con->in_length);
+    return ret == -1 ? -1 : SUCCESS;
+}
+
+/* Drives a client connection as far as it can go without blocking. Queued
+ * output is written first. Then the requests buffered or waiting in the
+ * socket are served one at a time, so that responses go out in order, until
+ * one is handed to a worker, the output backs up past the high water mark
+ * or there is no complete request left.
+ * @param reactor event loop owning the connection.
+ * @param con connection state of the client's connection in epoll.
+ * */
+static void drive_client_connection(reactor_t* reactor, epoll_conn_state* con)
+{
+    while (1)
     {
-        perror("Error in handle_client_response");
-        exit(EXIT_FAILURE);
+        if (write_client_output(reactor, con) == -1)
+        {
+            drop_client_connection(reactor, con);
+            return;
+        }
+        if (con->out_head == NULL)
+        {
+            if (con->close_after_flush)
+            {
+                drop_client_connection(reactor, con);
+                return;
+            }
+            if (con->deferred != NULL)
+            {
+                /* Socket is all ours again. Let the worker write */
+                request_item* reqitem = con->deferred;
+                con->deferred = NULL;
+                if (dispatch_request(con, reqitem) == -1)
+                {
+                    close_client_connection(reactor, con);
+                    return;
+                }
+            }
+        }
+        /* Picked up when the current request completes or the client has
+         * read enough of the output */
+        if (con->busy || con->paused || con->close_after_flush)
+            return;
+        int ret = serve_next_request(reactor, con);
+        if (ret == -1)
+        {
+            if (con->read_eof && con->in_length == 0 && con->out_head != NULL)
+            {
+                /* Client half closed after its last request. Let the
+                 * responses go out first */
+                con->close_after_flush = 1;
+                continue;
+            }
+            drop_client_connection(reactor, con);
+            return;
+        }
+        if (ret == HTTP_PARSE_INCOMPLETE)
+        {
+            /* Rest of the request arrives with the next EPOLLIN */
+            return;
+        }
     }
-    else if(read_count == 0)
+}
+
+/* Timeout of each phase, indexed by TIMER_PHASE_* */
+static const int phase_timeout_ms[] = {0, IDLE_TIMEOUT_MS,
+                                       HEADER_READ_TIMEOUT_MS,
+                                       WORKER_TIMEOUT_MS, FLUSH_TIMEOUT_MS};
+
+/* Works out what the connection is waiting for and sets the deadline for
+ * it. The deadline is set when the connection enters a phase, so a client
+ * trickling in a header byte by byte doesn't keep pushing it back. Only
+ * the flush deadline moves whenever the client takes some output, so slow
+ * but live readers aren't cut off */
+void update_connection_timer(reactor_t* reactor, epoll_conn_state* con)
+{
+    int phase;
+    if (con->closed || con->hangup)
+        phase = TIMER_PHASE_NONE; /* Cleaned up by the completion */
+    else if (con->out_head != NULL)
+        phase = TIMER_PHASE_FLUSH;
+    else if (con->busy)
+        phase = TIMER_PHASE_WORKER;
+    else if (con->in_length > 0)
+        phase = TIMER_PHASE_HEADER;
+    else
+        phase = TIMER_PHASE_IDLE;
+
+    if (phase == TIMER_PHASE_NONE)
+        timer_wheel_cancel(&reactor->timers, &con->timer);
+    else if (phase != con->timer_phase ||
+             (phase == TIMER_PHASE_FLUSH && con->output_progress))
+        timer_wheel_schedule(&reactor->timers, &con->timer,
+                             reactor->now_ms + phase_timeout_ms[phase]);
+    con->timer_phase = phase;
+    con->output_progress = 0;
+}
+
+/* Timer wheel callback for a connection which missed its deadline */
+void expire_connection(timer_entry_t* timer, void* arg)
+{
+    reactor_t* reactor = (reactor_t*)arg;
+    epoll_conn_state* con = (epoll_conn_state*)((char*)timer -
+                                    offsetof(epoll_conn_state, timer));
+    dbg_printf("Connection %d timed out in phase %d\n", con->client_fd,
+               con->timer_phase);
+    increment_timeout_count();
+    con->timer_phase = TIMER_PHASE_NONE;
+    drop_client_connection(reactor, con);
+}
+
+/* Serves the connection and sets its next deadline. On the io_uring
+ * backend, the next receive is submitted once the input buffer has room
+ * again */
+void handle_client_connection(reactor_t* reactor, epoll_conn_state* con)
+{
+    drive_client_connection(reactor, con);
+    if (con->closed)
+        return;
+    if (reactor->backend == EVENT_BACKEND_URING)
+        uring_arm_client_recv(reactor, con);
+    update_connection_timer(reactor, con);
+}
+
+/*
+ * Handle the response from the worker thread and queue it for the client.
+ * It is invoked for dynamic requests after the worker thread finishes
+ * generating the dynamic content. The output buffer moves to the
+ * connection's output queue without copying */
+int handle_client_response(request_item* item)
+{
+    if (item->response != NULL)
     {
-        /* When all of the data from the socket is read */
-        dbg_printf("Phew! Done reading all the data.. \n");
-        return RESPONSE_HANDLING_COMPLETE;
+        queue_client_output(item->con, item->response, item->response_length);
+        item->response = NULL;
     }
-    else if(read_count == -1 && errno == EAGAIN)
+    return RESPONSE_HANDLING_COMPLETE;
+}
+
+/* Ends a request whose response is queued, or was written by its worker.
+ * Persistent connections then go on with their next request, others are
+ * closed once the output is out */
+static void finish_request(reactor_t* reactor, request_item* item)
+{
+    epoll_conn_state* con = item->con;
+    con->busy = 0;
+    if (!item->keep_alive)
+        con->close_after_flush = 1;
+    free_request_item(item);
+    if (con->hangup)
+        close_client_connection(reactor, con);
+    else
+        handle_client_connection(reactor, con);
+}
+
+/* Releases a client's reference to the content of a coalesced response */
+static void release_shared_response_body(char* body)
+{
+    shared_response_t* shared = (shared_response_t*)(body -
+                                    offsetof(shared_response_t, body));
+    if (--shared->refs == 0)
+        Free(shared);
+}
+
+/* Hands the response of a completed request to the identical requests which
+ * joined it while it ran. They share one copy of the content, and each gets
+ * a header of its own, as they may differ in keep-alive. The request is no
+ * longer in flight, so the next identical one runs the module again */
+static void fan_out_response(reactor_t* reactor, request_item* item)
+{
+    request_item* follower;
+    untrack_inflight_request(reactor, item);
+    if (item->followers == NULL)
+        return;
+    size_t length = item->response_length - item->header_length;
+    shared_response_t* shared = Malloc(sizeof(shared_response_t) + length);
+    shared->refs = 1;
+    memcpy(shared->body, item->response + item->header_length, length);
+    while ((follower = item->followers) != NULL)
     {
-        /* Non blocking err */
-        dbg_printf("Not complete.. will try again\n");
+        item->followers = follower->next;
+        char* header = Malloc(MAX_RESPONSE_HEADER_LENGTH);
+        queue_client_output(follower->con, header,
+                http_format_response_header(header, item->status, length,
+                                            follower->keep_alive));
+        if (length > 0)
+        {
+            shared->refs++;
+            queue_client_shared_output(follower->con, shared->body, length,
+                                       release_shared_response_body);
+        }
+        increment_reply_count();
+        finish_request(reactor, follower);
     }
-    return RESPONSE_HANDLING_PARTIAL;
+    release_shared_response_body(shared->body);
 }
 
+/*
+ * Drains the completion queue. Completed dynamic requests carry the framed
+ * output of the module, which is queued for the client, unless the worker
+ * already wrote it (direct dispatch), and for the requests coalesced with
+ * it */
+void handle_completions(reactor_t* reactor)
+{
+    request_item* item;
+    while ((item = receive_completion(reactor)) != NULL)
+    {
+        if (item->coalesce)
+            fan_out_response(reactor, item);
+        if (handle_client_response(item) == RESPONSE_HANDLING_COMPLETE)
+            increment_reply_count();
+        finish_request(reactor, item);
+    }
+}
 
 /*
  * This function is invoked on a worker thread to serve dynamic content.
- * It has a internal TCP server to which master connects and passes the requests
- * This generates the required dynamic content and writes
- * the data back to the master's socket
+ * It takes requests from the job queue and generates the required dynamic
+ * content into a private memfd. The output is either handed back to the
+ * reactor through the completion queue (relay) or written to the client by
+ * the worker itself (direct), in which case only the completion goes back.
  */
 void* dynamic_content_worker_thread(void* arg)
 {
+    worker_t* worker = (worker_t*)arg;
     /* This thread is independent, its resources like stack, etc should
      * be freed automatically. */
     if (pthread_detach(pthread_self()) == -1)
@@ -175,148 +572,155 @@ void* dynamic_content_worker_thread(void* arg)
         return (void*)-1;
     }
 
-    /* TCP server to which master sends requests */
-    int server_sock = create_listen_tcp_socket(WORKER_THREAD_PORT,
-                                            MAX_LISTEN_QUEUE, SHARED_SOCKET);
-    /* Sequential server */
-    request_item item;
+    /* Modules write their output here. It is reused for every request */
+    int output_fd = create_memory_fd("dynamo-worker");
     while (1)
     {
-        int client_fd = accept(server_sock, NULL, NULL);
-        if (client_fd == -1)
-            continue;
-        /* Read the request from the master */
-        int r = read(client_fd, &item, sizeof(request_item));
+        request_item* item = receive_from_master(worker);
+        if (item == NULL)
+        {
+            /* Retired. The pool has more workers than it needs */
+            Close(output_fd);
+            return 0;
+        }
         /* Load the module and generate the content */
-        handle_dynamic_exec_lib(client_fd, item.resource_name);
-        Close(client_fd);
+        if (!item->direct)
+            capture_dynamic_response(output_fd, item);
+        else if (send_dynamic_response(output_fd, item) == -1)
+            item->keep_alive = 0; /* Connection is broken */
+        send_completion_to_master(item);
     }
     return 0;
 }
 
-int main(int argc, char *argv[])
+/* Out of descriptors. The clients stay in the listen queue until
+ * ACCEPT_RETRY_MS later, when some of the connections may have gone */
+static void pause_accepting(reactor_t* reactor, int error)
 {
-    init_cache();
-
-    increase_fd_limit(MAX_FD_LIMIT);
-    signal(SIGPIPE, SIG_IGN); /* Ignore Sigpipe */
-    int port = parse_port_number(argc, argv[1]);
-    if (port == -1)
-    {
-        fprintf(stderr, "Using default port number %d\n", DEFAULT_LISTEN_PORT);
-        port = DEFAULT_LISTEN_PORT;
-    }
-
-    /* Create a new server socket */
-    int server_sock = create_listen_tcp_socket(port, MAX_LISTEN_QUEUE,
-                                                    NON_SHARED_SOCKET);
-    make_socket_non_blocking(server_sock);
-
-    /* Create dynamic content generation workers */
-    create_threads(WORKER_THREAD_COUNT, dynamic_content_worker_thread);
+    if (!reactor->accept_paused)
+        fprintf(stderr, "Client accept: %s. Retrying every %d ms\n",
+                strerror(error), ACCEPT_RETRY_MS);
+    reactor->accept_paused = 1;
+    reactor->accept_retry_ms = reactor->now_ms + ACCEPT_RETRY_MS;
+}
 
-    /* Create statistics thread to print requests and replies rate*/
-    create_stat_thread();
+/* @return 1 if accepting was paused and is due again */
+static int accept_retry_due(reactor_t* reactor)
+{
+    if (reactor->accept_retry_ms == 0 ||
+        reactor->now_ms < reactor->accept_retry_ms)
+        return 0;
+    reactor->accept_retry_ms = 0;
+    return 1;
+}
 
-    /* Event polling code begins */
-    struct epoll_event listen_event;
-    struct epoll_event *events;
-    int epoll_fd = epoll_create1(0);
-    if (epoll_fd == -1)
+/* How long the event loop may wait: until the next deadline, or until
+ * accepting is retried */
+static int reactor_wait_timeout(reactor_t* reactor)
+{
+    int timeout = timer_wheel_timeout(&reactor->timers, reactor->now_ms);
+    if (reactor->accept_retry_ms != 0)
     {
-        perror("Epoll create");
-        exit(EXIT_FAILURE);
+        int retry = reactor->accept_retry_ms > reactor->now_ms ?
+                    (int)(reactor->accept_retry_ms - reactor->now_ms) : 0;
+        if (timeout == -1 || retry < timeout)
+            timeout = retry;
     }
+    return timeout;
+}
 
-    /* Server's socket for IN events */
-    memset(&listen_event, 0, sizeof(listen_event));
-    listen_event.data.fd = server_sock;
-    listen_event.events = EPOLLIN | EPOLLET; /* Edge triggered because we
-                                                want to get notified only
-                                                when a new connection is
-                                                accepted */
-
-    int ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sock, &listen_event);
-    if (ret == -1)
+/* Accepts all of the pending connections on the reactor's listening socket */
+void handle_new_connections(reactor_t* reactor)
+{
+    while (1)
     {
-        perror("Epoll Ctl Add");
-        exit(EXIT_FAILURE);
+        int cli_fd = accept(reactor->listen_fd, NULL, NULL);
+        if (cli_fd == -1)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                reactor->accept_paused = 0;
+                break;
+            }
+            else if (errno == ECONNABORTED || errno == EINTR)
+                continue; /* Client gave up while in the queue */
+            else if (errno == EMFILE || errno == ENFILE)
+            {
+                pause_accepting(reactor, errno);
+                break;
+            }
+            else
+            {
+                perror("Client accept");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (!admit_connection())
+        {
+            reject_connection(cli_fd);
+            continue;
+        }
+        update_connection_timer(reactor,
+                                add_client_fd_to_epoll(reactor, cli_fd));
     }
+}
 
-    events = calloc(MAX_EPOLL_EVENTS, sizeof(struct epoll_event));
-    /* Event loop */
+/* Event loop of a reactor. Accepts connections on its own listening socket,
+ * serves requests on them and writes back the responses completed by the
+ * workers */
+void* reactor_thread(void* arg)
+{
+    reactor_t* reactor = (reactor_t*)arg;
+    struct epoll_event* events = reactor->events;
     while (1)
     {
         int i;
-        int no_events = epoll_wait (epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        int no_events = epoll_wait(reactor->epoll_fd, events,
+                                   MAX_EPOLL_EVENTS,
+                                   reactor_wait_timeout(reactor));
+        reactor->now_ms = monotonic_ms();
         for (i = 0; i < no_events; i++)
         {
+            epoll_conn_state* con = events[i].data.ptr;
+            if (con->closed)
+                continue;
             if ((events[i].events & EPOLLERR) ||
                 (events[i].events & EPOLLHUP))
             {
-                epoll_conn_state* con = events[i].data.ptr;
-                switch(con->type)
+                if (con->type == EVENT_OWNER_LISTENER)
                 {
-                    case EVENT_OWNER_WORKER:    epoll_ctl(epoll_fd, EPOLL_CTL_DEL,
-                                                        con->worker_fd, NULL);
-                                                Free(con->client_con);
-                                                Close(con->worker_fd);
-                                                Free(con);
-                                                break;
-                    case EVENT_OWNER_CLIENT:    /* Will be cleaned by worker */
-                                                break;
-                    default:                    if (events[i].data.fd == server_sock)
-                                                {
-                                                    Close(events[i].data.fd);
-                                                }
+                    Close(reactor->listen_fd);
                 }
-            }
-            else if ((events[i].events & EPOLLIN) &&
-                    (events[i].data.fd == server_sock))
-            {
-                /* Server's Listening socket. Possible new conenction.
-                 * Accept all of the pending conenctions */
-                while (1)
+                else if (con->type == EVENT_OWNER_CLIENT)
                 {
-                    int cli_fd = accept(server_sock, NULL, NULL);
-                    if (cli_fd == -1)
-                    {
-                        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
-                            break;
-                        else
-                        {
-                            perror("Client accept");
-                            exit(EXIT_FAILURE);
-                        }
-                    }
-                    increment_request_count(); /* For stats */
-                    add_client_fd_to_epoll(epoll_fd, cli_fd);
+                    /* Connections with a request in flight are cleaned up
+                     * once their request completes */
+                    drop_client_connection(reactor, con);
                 }
             }
-            else if ((events[i].events & EPOLLIN))
+            else if (con->type == EVENT_OWNER_CLIENT)
             {
-                epoll_conn_state* con = events[i].data.ptr;
-                if (con->type == EVENT_OWNER_WORKER)
-                {
-                    /* Worker is ready with the output.
-                     * Send the output to the client */
-                    int ret = handle_client_response(epoll_fd, con);
-                    if (ret == RESPONSE_HANDLING_COMPLETE || ret == -1)
-                    {
-                        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, con->client_fd, NULL);
-                        Close(con->client_fd);
-                        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, con->worker_fd, NULL);
-                        Close(con->worker_fd);
-                        Free(con->client_con);
-                        Free(con);
-                        if (ret == RESPONSE_HANDLING_COMPLETE)
-                            increment_reply_count();
-                    }
-                }
-                else if(con->type == EVENT_OWNER_CLIENT)
+                /* Client's input is ready or its socket drained enough to
+                 * take more output. Serve the HTTP requests */
+                if (events[i].events & EPOLLIN)
+                    con->read_pending = 1; /* Read lazily by the parser */
+                handle_client_connection(reactor, con);
+            }
+            else if (events[i].events & EPOLLIN)
+            {
+                switch (con->type)
                 {
-                    /* Client's input is ready. Serve the HTTP request */
-                    handle_client_request(epoll_fd, con);
+                    case EVENT_OWNER_LISTENER:
+                                /* Server's Listening socket. Possible new
+                                 * conenction. Accept all of them */
+                                handle_new_connections(reactor);
+                                break;
+                    case EVENT_OWNER_COMPLETION:
+                                /* Workers are ready with the output.
+                                 * Send the output to the clients */
+                                acknowledge_completions(reactor);
+                                handle_completions(reactor);
+                                break;
                 }
             }
             else
@@ -325,5 +729,234 @@ int main(int argc, char *argv[])
                 exit(EXIT_FAILURE);
             }
         }
+        timer_wheel_advance(&reactor->timers, reactor->now_ms,
+                            expire_connection, reactor);
+        free_closed_connections(reactor);
+        /* The listening socket is edge triggered, so the clients left in
+         * its queue raise no new event */
+        if (accept_retry_due(reactor))
+            handle_new_connections(reactor);
+    }
+    return 0;
+}
+
+/* A connection's receive completed. The data is in its input buffer */
+void handle_uring_recv(reactor_t* reactor, epoll_conn_state* con, int res,
+                       unsigned flags)
+{
+    int ret = uring_receive_client_input(reactor, con, res, flags);
+    /* With the last send and its close submitted, the receive was only
+     * cancelled to let the socket go. The linked close finishes it */
+    if (!con->closed && !con->closing)
+    {
+        if (ret == -1)
+        {
+            /* Connections with a request in flight are cleaned up once
+             * their request completes */
+            drop_client_connection(reactor, con);
+        }
+        else
+        {
+            handle_client_connection(reactor, con);
+        }
+    }
+    uring_complete_op(reactor, con);
+}
+
+/* A connection's send completed. The sent part of the output queue is
+ * released and the connection goes on with its next request */
+void handle_uring_send(reactor_t* reactor, epoll_conn_state* con, int res)
+{
+    con->send_inflight = 0;
+    if (!con->closed)
+    {
+        if (res < 0)
+        {
+            drop_client_connection(reactor, con);
+        }
+        else
+        {
+            consume_client_output(con, res);
+            /* With a close linked behind, its completion decides */
+            if (!con->closing)
+                handle_client_connection(reactor, con);
+        }
+    }
+    uring_complete_op(reactor, con);
+}
+
+/* A connection's close completed. A close linked behind a send is
+ * cancelled if the send fails or goes out short */
+void handle_uring_close(reactor_t* reactor, epoll_conn_state* con, int res)
+{
+    if (res == -ECANCELED)
+    {
+        con->closing = 0;
+        if (con->closed)
+            close(con->client_fd); /* Send failed, the socket is still open */
+        else
+            handle_client_connection(reactor, con); /* Send the rest */
+    }
+    else
+    {
+        con->closed = 1;
+    }
+    uring_complete_op(reactor, con);
+}
+
+/* Registers a connection accepted by the multishot accept */
+void handle_uring_accept(reactor_t* reactor, int res, unsigned flags)
+{
+    if (res >= 0)
+    {
+        reactor->accept_paused = 0;
+        if (admit_connection())
+            update_connection_timer(reactor,
+                                    add_client_fd_to_uring(reactor, res));
+        else
+            reject_connection(res);
+    }
+    else if (res == -EMFILE || res == -ENFILE)
+    {
+        /* Rearmed once the pause is over */
+        pause_accepting(reactor, -res);
+    }
+    else
+    {
+        fprintf(stderr, "Client accept: %s\n", strerror(-res));
+    }
+    if (!(flags & IORING_CQE_F_MORE) && reactor->accept_retry_ms == 0)
+        uring_arm_accept(reactor);
+}
+
+/* Event loop of a reactor on the io_uring backend. Instead of waiting for
+ * readiness and then issuing the IO, the accepts, receives, sends and
+ * closes are submitted to the ring. One io_uring_enter per batch submits
+ * everything queued while handling the last completions and waits for the
+ * next ones */
+void* uring_reactor_thread(void* arg)
+{
+    reactor_t* reactor = (reactor_t*)arg;
+    uring_t* ring = &reactor->ring;
+    init_reactor_uring(reactor);
+    while (1)
+    {
+        struct io_uring_cqe* cqe;
+        uring_submit_and_wait_timeout(ring, 1, reactor_wait_timeout(reactor));
+        reactor->now_ms = monotonic_ms();
+        while ((cqe = uring_peek_cqe(ring)) != NULL)
+        {
+            epoll_conn_state* con = uring_user_ptr(cqe->user_data);
+            int op = uring_user_tag(cqe->user_data);
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(ring);
+            switch (op)
+            {
+                case URING_OP_ACCEPT:
+                            handle_uring_accept(reactor, res, flags);
+                            break;
+                case URING_OP_COMPLETION:
+                            /* Workers are ready with the output */
+                            reset_completion_signal(reactor);
+                            handle_completions(reactor);
+                            uring_arm_completion(reactor);
+                            break;
+                case URING_OP_RECV:
+                            handle_uring_recv(reactor, con, res, flags);
+                            break;
+                case URING_OP_SEND:
+                            handle_uring_send(reactor, con, res);
+                            break;
+                case URING_OP_CLOSE:
+                            handle_uring_close(reactor, con, res);
+                            break;
+                case URING_OP_CANCEL:
+                            uring_complete_op(reactor, con);
+                            break;
+            }
+        }
+        timer_wheel_advance(&reactor->timers, reactor->now_ms,
+                            expire_connection, reactor);
+        free_closed_connections(reactor);
+        if (accept_retry_due(reactor))
+            uring_arm_accept(reactor);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int fd_limit = increase_fd_limit(MAX_FD_LIMIT);
+    signal(SIGPIPE, SIG_IGN); /* Ignore Sigpipe */
+    config.reactor_count = DEFAULT_REACTOR_COUNT;
+    config.min_workers = DEFAULT_MIN_WORKERS;
+    config.max_workers = DEFAULT_MAX_WORKERS;
+    config.slow_workers = DEFAULT_SLOW_WORKERS;
+    config.dispatch_mode = DISPATCH_MODE_RELAY;
+    config.backend = EVENT_BACKEND_EPOLL;
+    config.max_connections = DEFAULT_MAX_CONNECTIONS;
+    config.max_queued_jobs = DEFAULT_MAX_QUEUED_JOBS;
+    config.cache_policy = CACHE_POLICY_CLOCK;
+    parse_server_args(argc, argv, &config);
+    if (config.port == -1)
+    {
+        fprintf(stderr, "Using default port number %d\n", DEFAULT_LISTEN_PORT);
+        config.port = DEFAULT_LISTEN_PORT;
+    }
+
+    if (config.max_connections > connection_fd_limit(fd_limit))
+    {
+        config.max_connections = connection_fd_limit(fd_limit);
+        printf("Connections limited to %d by the limit of %d descriptors\n",
+               config.max_connections, fd_limit);
+    }
+
+    init_cache(config.cache_policy);
+
+    /* Warm start. Every module is in the cache before the first client
+     * can connect */
+    if (config.preload)
+        preload_modules();
+
+    /* Create dynamic content generation workers */
+    init_admission_control(config.max_connections, config.max_queued_jobs);
+    init_dynamic_dispatch(config.min_workers, config.max_workers,
+                          config.slow_workers, MAX_WORKERS_PER_CORE,
+                          dynamic_content_worker_thread);
+
+    /* Every reactor gets its own listening socket. With more than one
+     * reactor, the sockets share the port and the kernel spreads incoming
+     * connections between them */
+    int shared = config.reactor_count > 1 ? SHARED_SOCKET : NON_SHARED_SOCKET;
+    reactor_t* reactors = Malloc(config.reactor_count * sizeof(reactor_t));
+    int i;
+    for (i = 0; i < config.reactor_count; i++)
+    {
+        int server_sock = create_listen_tcp_socket(config.port,
+                                                   MAX_LISTEN_QUEUE, shared);
+        init_reactor(&reactors[i], i, server_sock, MAX_EPOLL_EVENTS,
+                     config.backend);
+    }
+    printf("Running %d reactor(s) on port %d\n", config.reactor_count,
+                                                   config.port);
+
+    /* Create statistics thread to print requests and replies rate and the
+     * reactors' pool occupancy */
+    set_stat_reactors(reactors, config.reactor_count);
+    create_stat_thread();
+
+    /* Main thread runs the first reactor */
+    void* (*event_loop)(void*) = config.backend == EVENT_BACKEND_URING ?
+                                        uring_reactor_thread : reactor_thread;
+    for (i = 1; i < config.reactor_count; i++)
+    {
+        pthread_t thread_id;
+        if (pthread_create(&thread_id, NULL, event_loop, &reactors[i]) != 0)
+        {
+            perror("Reactor thread");
+            exit(EXIT_FAILURE);
+        }
     }
+    event_loop(&reactors[0]);
 }
@@ -0,0 +1,212 @@
+/* Hierarchical timer wheel.
+ * *************************
+ * The first level has a slot per tick for the next 256 ticks. Every upper
+ * level has 64 slots, each covering a whole turn of the level below. When
+ * the first level wraps around, the due slot of the next level is cascaded:
+ * its timers are spread over the level below. A timer is touched once per
+ * level at most, so all operations are O(1) no matter how many timers are
+ * scheduled.
+ *
+ * Timers too far in the future are clamped to the end of the last level.
+ * They fire late rather than early.
+ */
+#include "timer_wheel.h"
+#include <stddef.h>
+
+#define ROOT_MASK       (TIMER_WHEEL_ROOT_SIZE - 1)
+#define LEVEL_MASK      (TIMER_WHEEL_LEVEL_SIZE - 1)
+#define LEVEL_SHIFT(level) (TIMER_WHEEL_ROOT_BITS + \
+                            ((level) - 1) * TIMER_WHEEL_LEVEL_BITS)
+#define MAX_DELTA       ((1ULL << LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) - 1)
+
+/* Slot 'index' of 'level'. Level 0 is the root */
+static timer_entry_t* level_slot(timer_wheel_t* wheel, int level,
+                                 unsigned index)
+{
+    if (level == 0)
+        return &wheel->slots[index];
+    return &wheel->slots[TIMER_WHEEL_ROOT_SIZE +
+                         (level - 1) * TIMER_WHEEL_LEVEL_SIZE + index];
+}
+
+static void list_init(timer_entry_t* head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_add(timer_entry_t* head, timer_entry_t* timer)
+{
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_del(timer_entry_t* timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/* Moves the timers of 'head' onto 'list' and empties 'head' */
+static void list_move_all(timer_entry_t* head, timer_entry_t* list)
+{
+    if (head->next == head)
+    {
+        list_init(list);
+        return;
+    }
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    list_init(head);
+}
+
+/* Puts the timer in the slot matching its distance from the next tick */
+static void insert_timer(timer_wheel_t* wheel, timer_entry_t* timer)
+{
+    uint64_t expires = timer->expires;
+    if (expires < wheel->next_tick)
+    {
+        /* Already due. Fires with the next tick */
+        list_add(level_slot(wheel, 0, wheel->next_tick & ROOT_MASK), timer);
+        return;
+    }
+    uint64_t delta = expires - wheel->next_tick;
+    if (delta < TIMER_WHEEL_ROOT_SIZE)
+    {
+        list_add(level_slot(wheel, 0, expires & ROOT_MASK), timer);
+        return;
+    }
+    if (delta > MAX_DELTA)
+    {
+        expires = wheel->next_tick + MAX_DELTA;
+        timer->expires = expires;
+    }
+    int level;
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        if (delta < (1ULL << LEVEL_SHIFT(level + 1)) ||
+            level == TIMER_WHEEL_LEVELS - 1)
+            break;
+    }
+    list_add(level_slot(wheel, level,
+                        (expires >> LEVEL_SHIFT(level)) & LEVEL_MASK), timer);
+}
+
+/* Spreads the timers of a slot over the levels below.
+ * @return index of the slot, 0 when its level wrapped around as well */
+static unsigned cascade(timer_wheel_t* wheel, int level)
+{
+    unsigned index = (wheel->next_tick >> LEVEL_SHIFT(level)) & LEVEL_MASK;
+    timer_entry_t list;
+    list_move_all(level_slot(wheel, level, index), &list);
+    while (list.next != &list)
+    {
+        timer_entry_t* timer = list.next;
+        list_del(timer);
+        insert_timer(wheel, timer);
+    }
+    return index;
+}
+
+void timer_wheel_init(timer_wheel_t* wheel, uint64_t tick_ms,
+                      uint64_t now_ms)
+{
+    int i;
+    for (i = 0; i < TIMER_WHEEL_SLOTS; i++)
+        list_init(&wheel->slots[i]);
+    wheel->tick_ms = tick_ms;
+    wheel->next_tick = now_ms / tick_ms + 1;
+    wheel->count = 0;
+}
+
+void timer_entry_init(timer_entry_t* timer)
+{
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+int timer_pending(timer_entry_t* timer)
+{
+    return timer->next != NULL;
+}
+
+void timer_wheel_schedule(timer_wheel_t* wheel, timer_entry_t* timer,
+                          uint64_t expires_ms)
+{
+    if (timer_pending(timer))
+        list_del(timer);
+    else
+        wheel->count++;
+    /* Rounded up, so a timer never fires before its deadline */
+    timer->expires = (expires_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    insert_timer(wheel, timer);
+}
+
+void timer_wheel_cancel(timer_wheel_t* wheel, timer_entry_t* timer)
+{
+    if (!timer_pending(timer))
+        return;
+    list_del(timer);
+    wheel->count--;
+}
+
+void timer_wheel_advance(timer_wheel_t* wheel, uint64_t now_ms,
+                         timer_callback_t callback, void* arg)
+{
+    uint64_t now_tick = now_ms / wheel->tick_ms;
+    if (wheel->count == 0)
+    {
+        /* Nothing to fire. Skip the idle ticks in one go */
+        if (wheel->next_tick <= now_tick)
+            wheel->next_tick = now_tick + 1;
+        return;
+    }
+    while (wheel->next_tick <= now_tick)
+    {
+        unsigned index = wheel->next_tick & ROOT_MASK;
+        int level;
+        if (index == 0)
+        {
+            for (level = 1; level < TIMER_WHEEL_LEVELS; level++)
+            {
+                if (cascade(wheel, level) != 0)
+                    break;
+            }
+        }
+        /* Move the clock first, so that a timer scheduled from the
+         * callback lands in a future slot */
+        wheel->next_tick++;
+        timer_entry_t list;
+        list_move_all(level_slot(wheel, 0, index), &list);
+        while (list.next != &list)
+        {
+            timer_entry_t* timer = list.next;
+            list_del(timer);
+            wheel->count--;
+            callback(timer, arg);
+        }
+    }
+}
+
+int timer_wheel_timeout(timer_wheel_t* wheel, uint64_t now_ms)
+{
+    if (wheel->count == 0)
+        return -1;
+    /* Next busy slot of the root level, or the next cascade */
+    uint64_t tick = wheel->next_tick;
+    while ((tick & ROOT_MASK) != 0)
+    {
+        timer_entry_t* slot = level_slot(wheel, 0, tick & ROOT_MASK);
+        if (slot->next != slot)
+            break;
+        tick++;
+    }
+    uint64_t due_ms = tick * wheel->tick_ms;
+    return due_ms > now_ms ? (int)(due_ms - now_ms) : 0;
+}
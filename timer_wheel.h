@@ -0,0 +1,56 @@
+/*
+ * Header file for the hierarchical timer wheel.
+ * Every reactor keeps the deadlines of its connections in a wheel. Adding,
+ * moving and cancelling a timer is O(1), and expiring them never scans the
+ * connections which are not due.
+ */
+#ifndef __TIMER_WHEEL_H
+#define __TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_ROOT_BITS   8 /* 256 ticks in the first level */
+#define TIMER_WHEEL_LEVEL_BITS  6 /* 64 slots in every upper level */
+#define TIMER_WHEEL_LEVELS      4 /* Covers 2^26 ticks */
+#define TIMER_WHEEL_ROOT_SIZE   (1 << TIMER_WHEEL_ROOT_BITS)
+#define TIMER_WHEEL_LEVEL_SIZE  (1 << TIMER_WHEEL_LEVEL_BITS)
+#define TIMER_WHEEL_SLOTS       (TIMER_WHEEL_ROOT_SIZE + \
+                                 (TIMER_WHEEL_LEVELS - 1) * \
+                                 TIMER_WHEEL_LEVEL_SIZE)
+
+/* A timer is embedded in the structure it times out. Slots are circular
+ * lists with a dummy head, so unlinking needs no search */
+typedef struct timer_entry
+{
+    struct timer_entry* next;
+    struct timer_entry* prev;
+    uint64_t expires; /* Tick at which it fires */
+}timer_entry_t;
+
+typedef struct timer_wheel
+{
+    uint64_t tick_ms; /* Resolution of the wheel */
+    uint64_t next_tick; /* Next tick to be processed */
+    unsigned count; /* Timers scheduled */
+    timer_entry_t slots[TIMER_WHEEL_SLOTS];
+}timer_wheel_t;
+
+/* Called for every expired timer. The timer is already off the wheel and
+ * may be scheduled again */
+typedef void (*timer_callback_t)(timer_entry_t* timer, void* arg);
+
+void timer_wheel_init(timer_wheel_t* wheel, uint64_t tick_ms,
+                      uint64_t now_ms);
+void timer_entry_init(timer_entry_t* timer);
+int timer_pending(timer_entry_t* timer);
+/* Schedules, or moves, the timer to fire at 'expires_ms' */
+void timer_wheel_schedule(timer_wheel_t* wheel, timer_entry_t* timer,
+                          uint64_t expires_ms);
+void timer_wheel_cancel(timer_wheel_t* wheel, timer_entry_t* timer);
+/* Fires the timers which are due at 'now_ms' */
+void timer_wheel_advance(timer_wheel_t* wheel, uint64_t now_ms,
+                         timer_callback_t callback, void* arg);
+/* @return milliseconds until the wheel needs to be advanced again, or -1
+ * if it is empty. Meant as the timeout of the event loop's wait */
+int timer_wheel_timeout(timer_wheel_t* wheel, uint64_t now_ms);
+#endif /* __TIMER_WHEEL_H */
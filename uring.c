@@ -0,0 +1,309 @@
+/* Minimal io_uring wrapper.
+ * ************************
+ * Sets up a ring with the io_uring_setup system call and maps its
+ * submission and completion queues. Submission entries are filled in user
+ * space and handed to the kernel in batches; one io_uring_enter both
+ * submits them and waits for completions.
+ *
+ * Receives use a provided buffer ring. The kernel picks a buffer only when
+ * data arrives, so idle connections don't pin any receive memory.
+ */
+#include "uring.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define load_acquire(p)         __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v)     __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags, void* arg, size_t arg_size)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, arg_size);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg,
+                             unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* uring_init
+ * Creates a ring with 'entries' submission entries and four times as many
+ * completion entries, since multishot accepts post several completions per
+ * submission.
+ * @return 0 on success, -1 if io_uring is not available
+ */
+int uring_init(uring_t* ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(uring_t));
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+                   IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = entries * 4;
+    ring->ring_fd = io_uring_setup(entries, &params);
+    if (ring->ring_fd == -1 && errno == EINVAL)
+    {
+        /* Older kernel. Retry without the optional flags */
+        params.flags = IORING_SETUP_CQSIZE;
+        ring->ring_fd = io_uring_setup(entries, &params);
+    }
+    if (ring->ring_fd == -1)
+        return -1;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_EXT_ARG))
+    {
+        /* Kernels this old don't have multishot accept either */
+        close(ring->ring_fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    /* Both queues live in one mapping */
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes +
+                     params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                          IORING_OFF_SQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                      IORING_OFF_SQES);
+    if (ring->ring_ptr == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        close(ring->ring_fd);
+        return -1;
+    }
+
+    char* ptr = ring->ring_ptr;
+    ring->sq_head = (unsigned*)(ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(ptr + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(ptr + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned*)(ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(ptr + params.cq_off.cqes);
+
+    /* Submission entries are always used in ring order, so the index
+     * array is set up once */
+    unsigned* array = (unsigned*)(ptr + params.sq_off.array);
+    unsigned i;
+    for (i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+    return 0;
+}
+
+void uring_destroy(uring_t* ring)
+{
+    if (ring->buf_ring != NULL)
+    {
+        munmap(ring->buf_ring, ring->buf_count * sizeof(struct io_uring_buf));
+        free(ring->buf_base);
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(ring->ring_fd);
+}
+
+/* Sets up the buffer ring and gives all of the buffers to the kernel.
+ * @return 0 on success, -1 if the kernel can't provide buffers */
+int uring_setup_buffers(uring_t* ring, unsigned count, unsigned size,
+                        int group)
+{
+    struct io_uring_buf_reg reg;
+    size_t ring_bytes = count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE,
+                          MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    ring->buf_base = malloc((size_t)count * size);
+    if (ring->buf_ring == MAP_FAILED || ring->buf_base == NULL)
+    {
+        perror("Cannot allocate io_uring buffers");
+        exit(EXIT_FAILURE);
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (io_uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1)
+        == -1)
+        return -1;
+    ring->buf_count = count;
+    ring->buf_size = size;
+    ring->buf_tail = 0;
+    unsigned bid;
+    for (bid = 0; bid < count; bid++)
+        uring_recycle_buffer(ring, bid);
+    return 0;
+}
+
+char* uring_buffer(uring_t* ring, unsigned bid)
+{
+    return ring->buf_base + (size_t)bid * ring->buf_size;
+}
+
+void uring_recycle_buffer(uring_t* ring, unsigned bid)
+{
+    /* The ring's tail overlays the 'resv' field of the first entry, so the
+     * entry is filled in field by field */
+    struct io_uring_buf* buf =
+            &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    ring->buf_tail++;
+    store_release(&ring->buf_ring->tail, ring->buf_tail);
+}
+
+struct io_uring_sqe* uring_get_sqe(uring_t* ring)
+{
+    while (ring->sqe_tail - load_acquire(ring->sq_head) >= ring->sq_entries)
+    {
+        /* Ring is full. Let the kernel take what's there */
+        uring_submit_and_wait(ring, 0);
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+/* @return number of entries submitted or -1 on error */
+int uring_submit_and_wait(uring_t* ring, unsigned wait_nr)
+{
+    return uring_submit_and_wait_timeout(ring, wait_nr, -1);
+}
+
+int uring_submit_and_wait_timeout(uring_t* ring, unsigned wait_nr,
+                                  int timeout_ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    void* enter_arg = NULL;
+    size_t enter_arg_size = 0;
+    if (wait_nr > 0 && timeout_ms >= 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        enter_arg = &arg;
+        enter_arg_size = sizeof(arg);
+    }
+    store_release(ring->sq_tail, ring->sqe_tail);
+    unsigned to_submit = ring->sqe_tail - load_acquire(ring->sq_head);
+    while (1)
+    {
+        int ret = io_uring_enter(ring->ring_fd, to_submit, wait_nr, flags,
+                                 enter_arg, enter_arg_size);
+        if (ret >= 0)
+            return ret;
+        if (errno == ETIME)
+        {
+            /* Timed out waiting. The entries were still submitted */
+            return to_submit;
+        }
+        if (errno == EINTR)
+        {
+            /* Nothing was taken, or the count would have been returned */
+            continue;
+        }
+        if (errno == EBUSY || errno == EAGAIN)
+        {
+            /* Completion queue is backed up. Reap first */
+            return 0;
+        }
+        perror("io_uring_enter");
+        return -1;
+    }
+}
+
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == load_acquire(ring->cq_tail))
+        return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t* ring)
+{
+    store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe* sqe, int fd,
+                                 uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+/* Receives up to 'length' bytes into a buffer the kernel picks from
+ * 'group'. The buffer id comes back in the completion's flags */
+void uring_prep_recv_select(struct io_uring_sqe* sqe, int fd, size_t length,
+                            int group, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = length;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe* sqe, int fd, struct msghdr* msg,
+                        int flags, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_read(struct io_uring_sqe* sqe, int fd, void* buf,
+                     size_t length, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = length;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_close(struct io_uring_sqe* sqe, int fd, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+}
+
+/* Cancels the request submitted with user_data 'target' */
+void uring_prep_cancel(struct io_uring_sqe* sqe, uint64_t target,
+                       uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
@@ -0,0 +1,87 @@
+/*
+ * Header file for the io_uring wrapper used by the io_uring event backend.
+ * It talks to the kernel through the raw system calls, so the server does
+ * not depend on liburing. Only the few operations the reactor needs are
+ * wrapped.
+ */
+#ifndef __URING_H
+#define __URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/* user_data of a submission is a pointer with a small tag in its low bits,
+ * telling which operation completed. Pointers have to be 8 byte aligned */
+#define URING_TAG_MASK          7
+#define uring_user_data(ptr, tag) ((uint64_t)(uintptr_t)(ptr) | (tag))
+#define uring_user_ptr(data)    ((void*)(uintptr_t)((data) & ~(uint64_t)URING_TAG_MASK))
+#define uring_user_tag(data)    ((int)((data) & URING_TAG_MASK))
+
+typedef struct uring
+{
+    int ring_fd;
+    /* Submission ring. 'sqe_tail' counts the entries handed out, which
+     * become visible to the kernel on the next submit */
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    struct io_uring_sqe* sqes;
+    /* Completion ring */
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    void* ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+    /* Provided buffers, picked by the kernel when a receive completes */
+    struct io_uring_buf_ring* buf_ring;
+    char* buf_base;
+    unsigned buf_count;
+    unsigned buf_size;
+    unsigned short buf_tail;
+}uring_t;
+
+/* Create and destroy. Init returns -1 if the kernel has no usable io_uring.
+ * The ring must be used by the thread which created it */
+int uring_init(uring_t* ring, unsigned entries);
+void uring_destroy(uring_t* ring);
+
+/* Registers 'count' buffers of 'size' bytes as buffer group 'group'.
+ * 'count' must be a power of two */
+int uring_setup_buffers(uring_t* ring, unsigned count, unsigned size,
+                        int group);
+char* uring_buffer(uring_t* ring, unsigned bid);
+/* Hands a buffer picked by a receive back to the kernel */
+void uring_recycle_buffer(uring_t* ring, unsigned bid);
+
+/* Returns a cleared submission entry. Submits the pending ones first if
+ * the ring is full */
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+/* Submits the pending entries and waits for at least 'wait_nr' completions
+ * with a single io_uring_enter */
+int uring_submit_and_wait(uring_t* ring, unsigned wait_nr);
+/* Same, but gives up waiting after 'timeout_ms'. -1 waits forever */
+int uring_submit_and_wait_timeout(uring_t* ring, unsigned wait_nr,
+                                  int timeout_ms);
+/* Completions are consumed in order. Peek returns NULL if there are none */
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring);
+void uring_cqe_seen(uring_t* ring);
+
+/* Preparation of the operations used by the reactor */
+void uring_prep_accept_multishot(struct io_uring_sqe* sqe, int fd,
+                                 uint64_t user_data);
+void uring_prep_recv_select(struct io_uring_sqe* sqe, int fd, size_t length,
+                            int group, uint64_t user_data);
+void uring_prep_sendmsg(struct io_uring_sqe* sqe, int fd, struct msghdr* msg,
+                        int flags, uint64_t user_data);
+void uring_prep_read(struct io_uring_sqe* sqe, int fd, void* buf,
+                     size_t length, uint64_t user_data);
+void uring_prep_close(struct io_uring_sqe* sqe, int fd, uint64_t user_data);
+void uring_prep_cancel(struct io_uring_sqe* sqe, uint64_t target,
+                       uint64_t user_data);
+#endif /* __URING_H */
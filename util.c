@@ -7,6 +7,8 @@
  */
 #include <string.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <netinet/in.h>
 #include <stdio.h>
@@ -16,35 +18,58 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <dirent.h>
 #include "util.h"
 #include "dlfcn.h"
 #include "csapp.h"
 #include "cache.h"
+#include "job_queue.h"
+#include "worker_pool.h"
+#include "prefault.h"
+#include "response_cache.h"
 
-/* Statistics related */
-static long request_cnt = 0;
-static long reply_cnt = 0;
-static pthread_mutex_t replycnt_mutex;
+/* Statistics related. Updated by every reactor and worker thread */
+static atomic_long request_cnt = 0;
+static atomic_long reply_cnt = 0;
 
 /* Cache */
 static cache_t* cache;
 
+/* Workers, each with its own queue of requests. Modules which run long are
+ * served by a pool of their own, so that they don't hold up the others.
+ * Completions go back to the reactor which dispatched the request */
+static worker_pool_t* lanes[LANE_COUNT];
+static const char* lane_names[LANE_COUNT] = { "FAST", "SLOW" };
+
 /* Creates a worker for static request */
-void create_static_worker(int client_fd, void* (*func)(void*), char* res_name)
+void create_static_worker(request_item* item, void* (*func)(void*))
 {
     pthread_t thread_id;
-    request_item* item = create_static_request_item(res_name, client_fd);
     pthread_create(&thread_id, NULL, func, (void*) item);
 }
 
-/* This is a callback called when the library item is evicted from the cache */
+/* This is a callback called when the library item is evicted from the cache,
+ * or replaced by a new version, and no request runs it anymore */
 void library_eviction_callback(cache_data_item_t* item)
 {
-    printf("Unloading library %s\n", item->key.key_data);
+    if (item->value.value_data == NULL)
+        return; /* Rejected module, already closed */
+    printf("Unloading library %s version %u\n", item->key.key_data,
+           item->value.version);
     if (dlclose(item->value.value_data) < 0)
     {
         fprintf(stderr, "%s\n", dlerror());
     }
+    /* Only now that it is unloaded can its path name another version */
+    Close(item->value.snapshot_fd);
 }
 
 /* Closes the library and possibly unloads it from the address
@@ -57,11 +82,12 @@ void unload_dyn_library(void* handle)
     }
 }
 
-void* load_dyn_library(char* library_name)
+/* 'mode' is RTLD_LAZY or RTLD_NOW */
+void* load_dyn_library(char* library_name, int mode)
 {
     void (*execute)(int fd, char* args[], int count);
     char* error;
-    void* handle = dlopen(library_name, RTLD_LAZY);
+    void* handle = dlopen(library_name, mode);
     if (!handle)
     {
         fprintf(stderr, "%s\n", dlerror());
@@ -70,82 +96,365 @@ void* load_dyn_library(char* library_name)
     return handle;
 }
 
-/* Loads and runs the required .so module for the request */
-void handle_dynamic_exec_lib(int client_fd, char* resource_name)
+/* Copies the module at 'path' into a private memfd and loads it from
+ * there, through its /proc/self/fd path. A deploy can't change the copy
+ * under running requests, and no two loaded versions share a path, so a
+ * new version always loads beside the old one instead of dlopen handing
+ * back the old one.
+ * @return the handle, or NULL if the module can't be loaded. 'st' is the
+ * identity of the file which was copied */
+static void* load_module_snapshot(char* path, struct stat* st,
+                                  int* snapshot_fd, int mode)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    if (fstat(fd, st) == -1)
+    {
+        Close(fd);
+        return NULL;
+    }
+    int memfd = create_memory_fd(path);
+    off_t offset = 0;
+    while (offset < st->st_size)
+    {
+        ssize_t copied = sendfile(memfd, fd, &offset, st->st_size - offset);
+        if (copied <= 0)
+        {
+            if (copied == -1 && errno == EINTR)
+                continue;
+            perror("Copying module");
+            Close(fd);
+            Close(memfd);
+            return NULL;
+        }
+    }
+    Close(fd);
+
+    char proc_path[sizeof("/proc/self/fd/") + 12];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", memfd);
+    void* stale = dlopen(proc_path, RTLD_LAZY | RTLD_NOLOAD);
+    if (stale != NULL)
+    {
+        /* A library loaded from a closed fd of this number was never
+         * unloaded. Keep the number busy for good and use another */
+        unload_dyn_library(stale);
+        void* handle = load_module_snapshot(path, st, snapshot_fd, mode);
+        if (handle == NULL)
+            Close(memfd);
+        return handle;
+    }
+    void* handle = load_dyn_library(proc_path, mode);
+    if (handle == NULL)
+    {
+        Close(memfd);
+        return NULL;
+    }
+    *snapshot_fd = memfd;
+    return handle;
+}
+
+/* Modules are bound eagerly and prefaulted when they were preloaded at
+ * startup, so that reloads keep the first requests fast as well */
+static int eager_module_loading;
+
+/* Loads a new version of the module at the key's path into a new cache
+ * entry and resolves its entry point. A module without one is closed right
+ * away but still cached, so it is rejected without being loaded again
+ * until it changes. With 'eager', all of its symbols are bound and its
+ * code is paged in before it is returned.
+ * @return the entry or NULL if the module can't be loaded */
+static cache_entry_t* create_library_entry(cache_key_t* key, int eager)
+{
+    static atomic_uint module_versions;
+    struct stat st;
+    int snapshot_fd;
+    void* handle = load_module_snapshot(key->key_data, &st, &snapshot_fd,
+                                        eager ? RTLD_NOW : RTLD_LAZY);
+    if (handle == NULL)
+        return NULL;
+    dbg_printf("Creating a new cache entry\n");
+    cache_entry_t* entry = get_new_cache_entry();
+    entry->data = malloc(sizeof(cache_data_item_t));
+    copy_cache_key(&entry->data->key, key);
+    cache_value_t* value = &entry->data->value;
+    value->version = atomic_fetch_add(&module_versions, 1) + 1;
+    value->cgi_function = (void (*)(int))dlsym(handle, "cgi_function");
+    int* cache_ttl_ms = (int*)dlsym(handle, RESPONSE_TTL_SYMBOL);
+    value->cache_ttl_ms = cache_ttl_ms != NULL ? *cache_ttl_ms : 0;
+    atomic_init(&value->runtime_us, 0);
+    atomic_init(&value->slow, 0);
+    if (value->cgi_function == NULL)
+    {
+        fprintf(stderr, "%s has no cgi_function, rejected\n", key->key_data);
+        unload_dyn_library(handle);
+        Close(snapshot_fd);
+        handle = NULL;
+        snapshot_fd = -1;
+    }
+    else
+    {
+        if (eager)
+            prefault_library(handle);
+        printf("Loaded library %s version %u\n", key->key_data,
+               value->version);
+    }
+    value->value_data = handle;
+    value->snapshot_fd = snapshot_fd;
+    value->dev = st.st_dev;
+    value->ino = st.st_ino;
+    value->mtime = st.st_mtim;
+    entry->delete_callback = library_eviction_callback;
+    entry->data_size = st.st_size;
+    return entry;
+}
+
+/* Closes a module entry which was never published */
+static void free_library_entry(cache_entry_t* entry)
 {
-    int path_len = MAX_DLL_NAME_LENGTH + strlen(CGIBIN_DIR_NAME) + MAX_PATH_CHARS;
-    char lib_path[path_len];
-    snprintf(lib_path, path_len, "./%s/%s.so", CGIBIN_DIR_NAME, resource_name);
+    library_eviction_callback(entry->data);
+    free_cache_entry(entry);
+}
+
+/* Path of the module serving 'resource_name'. Also its key in the cache,
+ * so every lookup has to build it here */
+static void format_module_path(char path[MAX_MODULE_PATH_LENGTH],
+                               char* resource_name)
+{
+    snprintf(path, MAX_MODULE_PATH_LENGTH, "./%s/%s.so", CGIBIN_DIR_NAME,
+             resource_name);
+}
 
-    /* Get from cache */
+/* Folds a run of the module into its average run time, and moves it to the
+ * other lane once the average crosses that lane's threshold. The gap
+ * between the thresholds keeps a module close to them from flapping.
+ * Concurrent runs may lose an update, which doesn't matter for an average */
+static void record_module_runtime(cache_value_t* value, long runtime_us)
+{
+    long average = atomic_load_explicit(&value->runtime_us,
+                                        memory_order_relaxed);
+    if (average == 0)
+        average = runtime_us;
+    else
+        average += (runtime_us - average) >> RUNTIME_EWMA_SHIFT;
+    if (average == 0)
+        average = 1; /* Ran, if quicker than a microsecond */
+    atomic_store_explicit(&value->runtime_us, average, memory_order_relaxed);
+    if (average > SLOW_LANE_THRESHOLD_US)
+        atomic_store_explicit(&value->slow, 1, memory_order_relaxed);
+    else if (average < FAST_LANE_THRESHOLD_US)
+        atomic_store_explicit(&value->slow, 0, memory_order_relaxed);
+}
+
+/* Loads and runs the required .so module for the request. The module writes
+ * the response body to 'client_fd'. 'cache_ttl_ms' is set to how long the
+ * module lets its response be reused.
+ * @return HTTP_200, HTTP_404 if the module can't be loaded or HTTP_500 if
+ * it has no entry point */
+int handle_dynamic_exec_lib(int client_fd, char* resource_name,
+                            int* cache_ttl_ms)
+{
+    *cache_ttl_ms = 0;
+    char lib_path[MAX_MODULE_PATH_LENGTH];
+    format_module_path(lib_path, resource_name);
+
+    /* Get from cache. No lock is taken on a hit; the read section keeps
+     * the module loaded until the request is done with it */
     cache_key_t key;
-    strcpy(key.key_data, lib_path);
-    cache_entry_t* entry = get_cached_item_with_lock(cache, &key); /* Read
-                                                                      lock is
-                                                                      taken */
+    init_cache_key(&key, lib_path);
+    cache_entry_t* uncached = NULL;
+    cache_read_begin();
+    cache_entry_t* entry = get_cached_item(cache, &key);
     if (entry == NULL)
     {
         dbg_printf("Cache miss\n");
-        /* Cache miss */
-        void* handle = load_dyn_library(lib_path);
-        if (handle == NULL)
+        /* Cache miss. The module is loaded without any lock held and
+         * published under its shard's writer lock, unless another request
+         * got there first */
+        cache_read_end();
+        cache_entry_t* loaded = create_library_entry(&key,
+                                                     eager_module_loading);
+        get_cache_shard_wrlock(cache, &key);
+        entry = peek_cached_item(cache, &key);
+        if (entry != NULL)
         {
-            http_write_response_header(client_fd, HTTP_404);
-            return;
+            uncached = loaded;
         }
-        /* Add it to cache */
-        dbg_printf("Creating a new cache entry\n");
-        entry = get_new_cache_entry();
-        entry->data = malloc(sizeof(cache_data_item_t));
-        entry->data->key = key;
-        entry->data->value.value_data = handle;
-        entry->delete_callback = library_eviction_callback;
-        struct stat st;
-        if (stat(lib_path, &st) == -1)
+        else if (loaded != NULL)
         {
-            perror("stat");
-            st.st_size = 1024; /* avg size of a code */
+            entry = loaded;
+            if (add_to_cache(cache, loaded) == CACHE_INSERT_ERR)
+            {
+                printf("Cannot insert into cache\n");
+                uncached = loaded;
+            }
         }
-        entry->data_size = st.st_size;
-        Pthread_rwlock_rdlock(&entry->lock);
-        if (add_to_cache(cache, entry) == CACHE_INSERT_ERR)
+        /* Entered before unlocking, so no writer can free the entry in
+         * between */
+        cache_read_begin();
+        release_cache_shard_wrlock(cache, &key);
+        if (entry == NULL)
         {
-            printf("Cannot insert into cache\n");
-            Free(entry->data);
-            Free(entry);
+            cache_read_end();
+            return HTTP_404;
         }
     }
     dbg_printf("Cache hit\n");
-    void* handle = entry->data->value.value_data;
-    /* Success */
-    void (*func)(int) = dlsym(handle, "cgi_function");
-    http_write_response_header(client_fd, HTTP_200);
-    func(client_fd);
-    Pthread_rwlock_unlock(&entry->lock); /* Now free for anyone to evict this */
+    int status = HTTP_500;
+    void (*func)(int) = entry->data->value.cgi_function;
+    if (func != NULL)
+    {
+        /* Success */
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        func(client_fd);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        record_module_runtime(&entry->data->value,
+                              (end.tv_sec - start.tv_sec) * 1000000L +
+                              (end.tv_nsec - start.tv_nsec) / 1000);
+        status = HTTP_200;
+        *cache_ttl_ms = entry->data->value.cache_ttl_ms;
+    }
+    cache_read_end(); /* Now free for anyone to evict this */
+    if (uncached != NULL)
+        free_library_entry(uncached);
+    return status;
 }
 
-/* Handler for static request type (html, txt, jpg, etc) */
-void handle_static(int fd, char* resource_name)
+/* Creates an anonymous in-memory file. glibc's memfd_create wrapper needs
+ * _GNU_SOURCE, which clashes with csapp.h, so the system call is used */
+int create_memory_fd(const char* name)
+{
+    int fd = syscall(SYS_memfd_create, name, MFD_CLOEXEC);
+    if (fd == -1)
+    {
+        perror("memfd_create");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/* Runs the module for 'item' with its output going into 'output_fd', a
+ * memfd private to the calling worker, and formats the response header.
+ * The output of a module which allows it is kept in the response cache.
+ * @return length of the generated content */
+static off_t generate_dynamic_response(int output_fd, request_item* item,
+                                       char* header, int* header_length)
+{
+    int cache_ttl_ms;
+    int status = handle_dynamic_exec_lib(output_fd, item->resource_name,
+                                         &cache_ttl_ms);
+    item->status = status;
+    off_t length = lseek(output_fd, 0, SEEK_CUR);
+    if (length < 0)
+        length = 0;
+    if (status == HTTP_200 && cache_ttl_ms > 0)
+        store_cached_response(item->resource_name, output_fd, length,
+                              cache_ttl_ms);
+    *header_length = http_format_response_header(header, status, length,
+                                                 item->keep_alive);
+    return length;
+}
+
+/* Rewinds the worker's memfd so it can be reused for the next request
+ * without creating a new file descriptor */
+static void reset_output_fd(int output_fd)
+{
+    if (ftruncate(output_fd, 0) == -1)
+        perror("ftruncate worker output");
+    lseek(output_fd, 0, SEEK_SET);
+}
+
+/* Relay dispatch. Copies the framed response (header with Content-Length
+ * followed by the generated content) into the item, to be written to the
+ * client by the reactor. */
+void capture_dynamic_response(int output_fd, request_item* item)
+{
+    char header[MAX_RESPONSE_HEADER_LENGTH];
+    int header_length;
+    off_t length = generate_dynamic_response(output_fd, item, header,
+                                             &header_length);
+    item->response = Malloc(header_length + length);
+    memcpy(item->response, header, header_length);
+    if (length > 0 &&
+        pread(output_fd, item->response + header_length, length, 0) != length)
+    {
+        perror("pread worker output");
+        length = 0;
+    }
+    item->header_length = header_length;
+    item->response_length = header_length + length;
+    reset_output_fd(output_fd);
+}
+
+/* Direct dispatch. The worker owns the client's socket until it hands the
+ * item back, and sends the framed response on it itself: the header is
+ * written and the content is sendfile()d out of the memfd. The reactor only
+ * gets the completion.
+ * @return -1 if the client connection failed */
+int send_dynamic_response(int output_fd, request_item* item)
+{
+    char header[MAX_RESPONSE_HEADER_LENGTH];
+    int header_length;
+    int ret = 0;
+    off_t length = generate_dynamic_response(output_fd, item, header,
+                                             &header_length);
+    if (socket_write_all(item->client_fd, header, header_length) == -1 ||
+        socket_sendfile_all(item->client_fd, output_fd, 0, length) == -1)
+    {
+        ret = -1;
+    }
+    reset_output_fd(output_fd);
+    return ret;
+}
+
+/* Sends a static file with a framed response header.
+ * @return -1 if the client connection failed */
+static int send_static_file(int fd, char* resource_name, int keep_alive)
 {
     int path_len = MAX_RESOURCE_NAME_LENGTH + strlen(STATIC_DIR_NAME) + MAX_PATH_CHARS;
     char res_path[path_len];
+    char header[MAX_RESPONSE_HEADER_LENGTH];
+    int header_length;
     snprintf(res_path, path_len, "./%s/%s", STATIC_DIR_NAME, resource_name);
     /* Now read and write the resource */
+    struct stat st;
     int filefd = open(res_path, O_RDONLY);
-    if (filefd == -1)
+    if (filefd == -1 || fstat(filefd, &st) == -1)
     {
         perror("open");
-        http_write_response_header(fd, HTTP_404);
-        return;
+        if (filefd != -1)
+            Close(filefd);
+        header_length = http_format_response_header(header, HTTP_404, 0,
+                                                    keep_alive);
+        return socket_write_all(fd, header, header_length);
     }
-    http_write_response_header(fd, HTTP_200);
-    int read_count;
-    while ((read_count = sendfile(fd, filefd, 0, MAX_READ_LENGTH)) > 0);
-    if (read_count == -1)
+    header_length = http_format_response_header(header, HTTP_200, st.st_size,
+                                                keep_alive);
+    int ret = socket_write_all(fd, header, header_length);
+    if (ret == 0)
     {
-        perror("sendfile");
+        ret = socket_sendfile_all(fd, filefd, 0, st.st_size);
+        if (ret == -1)
+            perror("sendfile");
     }
     Close(filefd);
+    return ret;
+}
+
+/* Handler for static request type (html, txt, jpg, etc) */
+void handle_static(int fd, char* resource_name)
+{
+    send_static_file(fd, resource_name, 0);
+}
+
+/* Handler for static requests coming from a reactor. The connection is
+ * kept open if the client asked for it.
+ * @return -1 if the client connection failed */
+int handle_static_request(request_item* item)
+{
+    return send_static_file(item->client_fd, item->resource_name,
+                            item->keep_alive);
 }
 
 int make_socket_non_blocking (int sfd)
@@ -167,18 +476,39 @@ int make_socket_non_blocking (int sfd)
     return 0;
 }
 
+/* Raises the fd resource limit to 'max_fds'. Without the privilege to raise
+ * the hard limit, the soft limit goes as far as the hard one.
+ * @return the limit in effect */
 int increase_fd_limit(int max_fds)
 {
-    /* Increase the max fd resource limit */
     struct rlimit res;
     res.rlim_cur = max_fds;
     res.rlim_max = max_fds;
     if(setrlimit(RLIMIT_NOFILE, &res) == -1)
     {
 	    perror("Resource FD limit");
-        return -1;
+        if (getrlimit(RLIMIT_NOFILE, &res) == 0 &&
+            res.rlim_cur < res.rlim_max)
+        {
+            res.rlim_cur = res.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &res);
+        }
     }
-    return 1;
+    if (getrlimit(RLIMIT_NOFILE, &res) == -1)
+        return max_fds;
+    return res.rlim_cur > (rlim_t)INT_MAX ? INT_MAX : (int)res.rlim_cur;
+}
+
+/* Connections the server can take with 'fd_limit' descriptors. Past them
+ * accept() fails and the client can't even be told to retry, so the limit
+ * has to shed them first. CONNECTION_FD_RESERVE are left for everything
+ * else, or half of them on a small limit */
+int connection_fd_limit(int fd_limit)
+{
+    int connections = fd_limit - CONNECTION_FD_RESERVE;
+    if (connections < fd_limit / 2)
+        connections = fd_limit / 2;
+    return connections;
 }
 
 int parse_port_number(int argc, char* argv)
@@ -197,6 +527,88 @@ int parse_port_number(int argc, char* argv)
     return -1;
 }
 
+/* Parses "[-r reactors] [-d] [port]". Port is -1 when it is not given */
+void parse_server_args(int argc, char* argv[], server_config_t* config)
+{
+    int opt;
+    config->port = -1;
+    while ((opt = getopt(argc, argv, "r:duc:q:pe:w:W:s:g")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r':   config->reactor_count = atoi(optarg);
+                        if (config->reactor_count <= 0)
+                        {
+                            printf("Provide a valid reactor count\n");
+                            exit(EXIT_FAILURE);
+                        }
+                        break;
+            case 'd':   config->dispatch_mode = DISPATCH_MODE_DIRECT;
+                        break;
+            case 'u':   config->backend = EVENT_BACKEND_URING;
+                        break;
+            case 'c':   config->max_connections = atoi(optarg);
+                        if (config->max_connections <= 0)
+                        {
+                            printf("Provide a valid connection limit\n");
+                            exit(EXIT_FAILURE);
+                        }
+                        break;
+            case 'q':   config->max_queued_jobs = atoi(optarg);
+                        if (config->max_queued_jobs <= 0)
+                        {
+                            printf("Provide a valid job queue limit\n");
+                            exit(EXIT_FAILURE);
+                        }
+                        break;
+            case 'p':   config->preload = 1;
+                        break;
+            case 'e':   if (strcmp(optarg, "clock") == 0)
+                            config->cache_policy = CACHE_POLICY_CLOCK;
+                        else if (strcmp(optarg, "tinylfu") == 0)
+                            config->cache_policy = CACHE_POLICY_TINYLFU;
+                        else
+                        {
+                            printf("Cache policy is clock or tinylfu\n");
+                            exit(EXIT_FAILURE);
+                        }
+                        break;
+            case 'w':   config->min_workers = atoi(optarg);
+                        if (config->min_workers <= 0)
+                        {
+                            printf("Provide a valid worker count\n");
+                            exit(EXIT_FAILURE);
+                        }
+                        break;
+            case 'W':   config->max_workers = atoi(optarg);
+                        if (config->max_workers <= 0)
+                        {
+                            printf("Provide a valid worker count\n");
+                            exit(EXIT_FAILURE);
+                        }
+                        break;
+            case 's':   config->slow_workers = atoi(optarg);
+                        if (config->slow_workers <= 0)
+                        {
+                            printf("Provide a valid worker count\n");
+                            exit(EXIT_FAILURE);
+                        }
+                        break;
+            case 'g':   config->coalesce = 1;
+                        break;
+            default:    fprintf(stderr, "Usage: %s [-r reactors] [-d] [-u] "
+                                "[-c max_connections] [-q max_queued_jobs] "
+                                "[-p] [-e clock|tinylfu] [-w min_workers] "
+                                "[-W max_workers] [-s slow_workers] [-g] "
+                                "[port]\n", argv[0]);
+                        exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc)
+        config->port = parse_port_number(SERVER_REQUIRED_CMD_ARG_COUNT,
+                                         argv[optind]);
+}
+
 int create_listen_tcp_socket(int port, int backlog, int socket_shared)
 {
     int sfd = Socket(AF_INET, SOCK_STREAM, 0);
@@ -232,119 +644,945 @@ int create_threads(int no_threads, void* (*func)(void*))
 }
 
 /* Create request items for communication between master and worker threads */
-request_item* create_dynamic_request_item(char* name)
+request_item* create_dynamic_request_item(reactor_t* reactor, char* name)
 {
-    request_item* item = malloc(sizeof(request_item));
-    memset(item, 0, sizeof(item));
+    request_item* item = mem_pool_alloc(&reactor->item_pool);
+    memset(item, 0, sizeof(request_item));
     sprintf(item->resource_name, "%s", name);
+    item->reactor = reactor;
     return item;
 }
 
 /* Create request items for communication between master and worker threads */
-request_item* create_static_request_item(char* name, int client_fd)
+request_item* create_static_request_item(reactor_t* reactor, char* name,
+                                        int client_fd)
 {
-    request_item* item = malloc(sizeof(request_item));
-    memset(item, 0, sizeof(item));
+    request_item* item = mem_pool_alloc(&reactor->item_pool);
+    memset(item, 0, sizeof(request_item));
     sprintf(item->resource_name, "%s", name);
     item->client_fd = client_fd;
+    item->reactor = reactor;
     return item;
 }
 
-void add_client_fd_to_epoll(int epollfd, int cli_fd)
+/* Bucket of the reactor's in-flight table for a resource name */
+static request_item** inflight_bucket(reactor_t* reactor, char* name)
 {
-    struct epoll_event event;
-    epoll_conn_state* conn = malloc(sizeof(epoll_conn_state));
+    cache_key_t key;
+    init_cache_key(&key, name);
+    return &reactor->inflight[key.hash & (INFLIGHT_TABLE_SIZE - 1)];
+}
+
+/* Dynamic request for 'name' which is being run by a worker, if any. The
+ * name carries both the module and the arguments of the request. Only the
+ * reactor owning the table touches it, so no lock is taken */
+request_item* find_inflight_request(reactor_t* reactor, char* name)
+{
+    request_item* item = *inflight_bucket(reactor, name);
+    while (item != NULL && strcmp(item->resource_name, name) != 0)
+        item = item->next;
+    return item;
+}
+
+/* Lets identical requests join 'item' until it completes */
+void track_inflight_request(reactor_t* reactor, request_item* item)
+{
+    request_item** bucket = inflight_bucket(reactor, item->resource_name);
+    item->coalesce = 1;
+    item->next = *bucket;
+    *bucket = item;
+}
+
+void untrack_inflight_request(reactor_t* reactor, request_item* item)
+{
+    request_item** link = inflight_bucket(reactor, item->resource_name);
+    while (*link != item)
+        link = &(*link)->next;
+    *link = item->next;
+    item->next = NULL;
+    item->coalesce = 0;
+}
+
+/* Allocates and sets up the state of a newly accepted client */
+static epoll_conn_state* create_client_connection(reactor_t* reactor,
+                                                  int cli_fd)
+{
+    epoll_conn_state* conn = mem_pool_alloc(&reactor->conn_pool);
     conn->client_fd = cli_fd;
-    conn->worker_fd = -1;
     conn->type = EVENT_OWNER_CLIENT;
+    conn->busy = 0;
+    conn->in_length = 0;
+    conn->read_pending = 0;
+    conn->read_eof = 0;
+    http_parser_init(&conn->parser);
+    init_header(&conn->header);
+    conn->hangup = 0;
+    conn->out_head = NULL;
+    conn->out_tail = NULL;
+    conn->out_bytes = 0;
+    conn->paused = 0;
+    conn->close_after_flush = 0;
+    conn->deferred = NULL;
+    conn->closed = 0;
+    conn->next_closed = NULL;
+    conn->pending_ops = 0;
+    conn->recv_armed = 0;
+    conn->send_inflight = 0;
+    conn->closing = 0;
+    timer_entry_init(&conn->timer);
+    conn->timer_phase = TIMER_PHASE_NONE;
+    conn->output_progress = 0;
+    return conn;
+}
+
+epoll_conn_state* add_client_fd_to_epoll(reactor_t* reactor, int cli_fd)
+{
+    struct epoll_event event;
+    epoll_conn_state* conn = create_client_connection(reactor, cli_fd);
+    make_socket_non_blocking(cli_fd);
 
     event.data.ptr = conn;
-    event.events = EPOLLIN | EPOLLET | EPOLLHUP | EPOLLERR;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLHUP | EPOLLERR;
                     /* Edge triggered client.
                      * We get all the contents of a request from client in
-                     * one shot */
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, cli_fd, &event) == -1)
+                     * one shot. EPOLLOUT is only reported when the socket
+                     * turns writable again, which is when a parked
+                     * output queue can make progress */
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, cli_fd, &event) == -1)
     {
         perror("epoll add client fd");
         exit(EXIT_FAILURE);
     }
+    return conn;
+}
+
+/* The socket stays blocking. The ring waits for it on its own, and the
+ * workers writing to it directly don't have to poll */
+epoll_conn_state* add_client_fd_to_uring(reactor_t* reactor, int cli_fd)
+{
+    epoll_conn_state* conn = create_client_connection(reactor, cli_fd);
+    uring_arm_client_recv(reactor, conn);
+    return conn;
+}
+
+/* Gives the connection state back to the reactor's pool. The connection
+ * must already be closed */
+void free_client_connection(reactor_t* reactor, epoll_conn_state* con)
+{
+    /* A request may have been cut off halfway through its header */
+    free_kvpairs_in_header(&con->header);
+    mem_pool_free(&reactor->conn_pool, con);
+    release_connection();
+}
+
+
+/* Appends 'data' to the connection's output queue. The queue takes
+ * ownership of 'data'. Crossing the high water mark pauses the connection */
+void queue_client_output(epoll_conn_state* con, char* data, size_t length)
+{
+    if (length == 0)
+    {
+        Free(data);
+        return;
+    }
+    output_buffer_t* buf = Malloc(sizeof(output_buffer_t));
+    buf->data = data;
+    buf->owned = 1;
+    buf->release = NULL;
+    buf->length = length;
+    buf->offset = 0;
+    buf->next = NULL;
+    if (con->out_tail == NULL)
+        con->out_head = buf;
+    else
+        con->out_tail->next = buf;
+    con->out_tail = buf;
+    con->out_bytes += length;
+    if (con->out_bytes > OUTPUT_HIGH_WATER_MARK)
+        con->paused = 1;
+}
+
+/* Appends a reply which lives for the whole run of the server, like the
+ * precomputed 503. It is not copied and not freed */
+void queue_client_static_output(epoll_conn_state* con, const char* data,
+                                size_t length)
+{
+    queue_client_output(con, (char*)data, length);
+    con->out_tail->owned = 0;
+}
+
+/* Appends data shared with others, like a cached response. It is not
+ * copied, and 'release' is called once it went out */
+void queue_client_shared_output(epoll_conn_state* con, char* data,
+                                size_t length, void (*release)(char* data))
+{
+    if (length == 0)
+    {
+        release(data);
+        return;
+    }
+    queue_client_output(con, data, length);
+    con->out_tail->owned = 0;
+    con->out_tail->release = release;
+}
+
+static void free_output_buffer(output_buffer_t* buf)
+{
+    if (buf->release != NULL)
+        buf->release(buf->data);
+    else if (buf->owned)
+        Free(buf->data);
+    Free(buf);
+}
+
+/* Points 'iov' at the start of the output queue.
+ * @return number of iovecs filled in */
+static int fill_output_iovecs(epoll_conn_state* con, struct iovec* iov)
+{
+    int count = 0;
+    output_buffer_t* buf;
+    for (buf = con->out_head; buf && count < MAX_OUTPUT_IOVECS;
+         buf = buf->next)
+    {
+        iov[count].iov_base = buf->data + buf->offset;
+        iov[count].iov_len = buf->length - buf->offset;
+        count++;
+    }
+    return count;
+}
+
+/* Releases the 'written' bytes at the head of the output queue and resumes
+ * the connection once the client drained it below the low water mark */
+void consume_client_output(epoll_conn_state* con, size_t written)
+{
+    if (written > 0)
+        con->output_progress = 1;
+    con->out_bytes -= written;
+    /* Release the buffers which went out completely */
+    while (written > 0)
+    {
+        output_buffer_t* buf = con->out_head;
+        size_t left = buf->length - buf->offset;
+        if (written < left)
+        {
+            buf->offset += written;
+            break;
+        }
+        written -= left;
+        con->out_head = buf->next;
+        free_output_buffer(buf);
+    }
+    if (con->out_head == NULL)
+        con->out_tail = NULL;
+    if (con->out_bytes <= OUTPUT_LOW_WATER_MARK)
+        con->paused = 0;
+}
+
+/* Writes as much of the output queue as the socket takes without blocking.
+ * Several queued buffers go out in one writev style system call. Whatever
+ * is left stays parked until EPOLLOUT.
+ * @return -1 if the connection failed, else bytes still queued */
+int flush_client_output(epoll_conn_state* con)
+{
+    while (con->out_head != NULL)
+    {
+        struct iovec iov[MAX_OUTPUT_IOVECS];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = fill_output_iovecs(con, iov);
+        /* MSG_DONTWAIT makes this write non-blocking, whatever the mode of
+         * the socket is */
+        ssize_t written = sendmsg(con->client_fd, &msg,
+                                  MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (written == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        consume_client_output(con, written);
+    }
+    if (con->out_bytes <= OUTPUT_LOW_WATER_MARK)
+        con->paused = 0;
+    return con->out_bytes;
+}
+
+/* Reads whatever the client sent into the connection's input buffer, until
+ * the socket has nothing more or the buffer is full. Never blocks.
+ * read_pending stays set when the buffer filled up before the socket was
+ * drained, since the edge triggered epoll won't report that input again.
+ * @return -1 if the connection failed */
+int read_client_input(epoll_conn_state* con)
+{
+    while (con->in_length < MAX_REQUEST_BUFFER_LENGTH)
+    {
+        ssize_t count = read(con->client_fd, con->in_buf + con->in_length,
+                             MAX_REQUEST_BUFFER_LENGTH - con->in_length);
+        if (count > 0)
+        {
+            con->in_length += count;
+        }
+        else if (count == 0)
+        {
+            con->read_eof = 1;
+            con->read_pending = 0;
+            return 0;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            con->read_pending = 0;
+            return 0;
+        }
+        else if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Sets up the reactor's ring and its provided receive buffers, and starts
+ * accepting. Runs on the reactor's thread, the only one submitting to the
+ * ring */
+void init_reactor_uring(reactor_t* reactor)
+{
+    if (uring_init(&reactor->ring, URING_ENTRIES) == -1 ||
+        uring_setup_buffers(&reactor->ring, URING_BUFFER_COUNT,
+                            MAX_READ_LENGTH, URING_BUFFER_GROUP) == -1)
+    {
+        perror("io_uring is not available");
+        exit(EXIT_FAILURE);
+    }
+    uring_arm_accept(reactor);
+    uring_arm_completion(reactor);
+}
+
+/* A single multishot accept keeps posting a completion per new connection
+ * until the kernel drops it */
+void uring_arm_accept(reactor_t* reactor)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(&reactor->ring);
+    uring_prep_accept_multishot(sqe, reactor->listen_fd,
+            uring_user_data(&reactor->listen_state, URING_OP_ACCEPT));
+}
+
+/* Reads the completion eventfd. The read completes once a worker signals */
+void uring_arm_completion(reactor_t* reactor)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(&reactor->ring);
+    uring_prep_read(sqe, reactor->completion_fd, &reactor->completion_count,
+                    sizeof(reactor->completion_count),
+                    uring_user_data(&reactor->completion_state,
+                                    URING_OP_COMPLETION));
+}
+
+/* Keeps one receive in flight while the input buffer has room. The amount
+ * asked for never exceeds the room left, so the data always fits */
+void uring_arm_client_recv(reactor_t* reactor, epoll_conn_state* con)
+{
+    size_t room = MAX_REQUEST_BUFFER_LENGTH - con->in_length;
+    if (con->recv_armed || con->read_eof || con->closing || room == 0)
+        return;
+    if (room > MAX_READ_LENGTH)
+        room = MAX_READ_LENGTH;
+    struct io_uring_sqe* sqe = uring_get_sqe(&reactor->ring);
+    uring_prep_recv_select(sqe, con->client_fd, room, URING_BUFFER_GROUP,
+                           uring_user_data(con, URING_OP_RECV));
+    con->recv_armed = 1;
+    con->pending_ops++;
+}
+
+/* Moves a completed receive into the connection's input buffer and hands
+ * the provided buffer back to the kernel.
+ * @return -1 if the connection failed */
+int uring_receive_client_input(reactor_t* reactor, epoll_conn_state* con,
+                               int res, unsigned flags)
+{
+    con->recv_armed = 0;
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0)
+        {
+            memcpy(con->in_buf + con->in_length,
+                   uring_buffer(&reactor->ring, bid), res);
+            con->in_length += res;
+        }
+        uring_recycle_buffer(&reactor->ring, bid);
+    }
+    if (res == 0)
+        con->read_eof = 1;
+    else if (res == -ECANCELED || con->closing)
+        return 0; /* Cancelled for the last send. Its close finishes it */
+    else if (res < 0 && res != -ENOBUFS && res != -EINTR)
+        return -1;
+    /* Out of buffers (ENOBUFS) is retried with the next receive */
+    return 0;
+}
+
+/* Submits the head of the output queue as one sendmsg. When the connection
+ * is to be closed after this output, the close is linked behind the send,
+ * and both go to the kernel in the same submission. Nothing is queued
+ * while a send is in flight, as the kernel still uses the iovecs */
+void uring_submit_client_output(reactor_t* reactor, epoll_conn_state* con)
+{
+    if (con->send_inflight || con->closing || con->out_head == NULL)
+        return;
+    int count = fill_output_iovecs(con, con->send_iov);
+    size_t length = 0;
+    int i;
+    for (i = 0; i < count; i++)
+        length += con->send_iov[i].iov_len;
+    memset(&con->send_msg, 0, sizeof(struct msghdr));
+    con->send_msg.msg_iov = con->send_iov;
+    con->send_msg.msg_iovlen = count;
+
+    int last = con->close_after_flush && !con->busy &&
+               length == con->out_bytes;
+    if (last && con->recv_armed)
+    {
+        /* The pending receive holds the socket open */
+        uring_prep_cancel(uring_get_sqe(&reactor->ring),
+                          uring_user_data(con, URING_OP_RECV),
+                          uring_user_data(con, URING_OP_CANCEL));
+        con->pending_ops++;
+    }
+    struct io_uring_sqe* sqe = uring_get_sqe(&reactor->ring);
+    uring_prep_sendmsg(sqe, con->client_fd, &con->send_msg,
+                       MSG_NOSIGNAL | MSG_WAITALL,
+                       uring_user_data(con, URING_OP_SEND));
+    con->send_inflight = 1;
+    con->pending_ops++;
+    if (last)
+    {
+        /* A failed or short send cancels the close */
+        sqe->flags |= IOSQE_IO_LINK;
+        uring_prep_close(uring_get_sqe(&reactor->ring), con->client_fd,
+                         uring_user_data(con, URING_OP_CLOSE));
+        con->closing = 1;
+        con->pending_ops++;
+    }
+}
+
+/* Closes the client's connection through the ring. Operations still in
+ * flight on the socket are cancelled, since they keep it open */
+void uring_close_client(reactor_t* reactor, epoll_conn_state* con)
+{
+    if (con->recv_armed)
+    {
+        uring_prep_cancel(uring_get_sqe(&reactor->ring),
+                          uring_user_data(con, URING_OP_RECV),
+                          uring_user_data(con, URING_OP_CANCEL));
+        con->pending_ops++;
+    }
+    if (con->send_inflight)
+    {
+        /* Also cancels a close linked behind the send, whose completion
+         * then closes the socket */
+        uring_prep_cancel(uring_get_sqe(&reactor->ring),
+                          uring_user_data(con, URING_OP_SEND),
+                          uring_user_data(con, URING_OP_CANCEL));
+        con->pending_ops++;
+    }
+    if (!con->closing)
+    {
+        uring_prep_close(uring_get_sqe(&reactor->ring), con->client_fd,
+                         uring_user_data(con, URING_OP_CLOSE));
+        con->closing = 1;
+        con->pending_ops++;
+    }
+    con->closed = 1;
+}
+
+/* Called for every completion of an operation on a client's connection.
+ * A closed connection is freed after the batch once its last operation is
+ * in */
+void uring_complete_op(reactor_t* reactor, epoll_conn_state* con)
+{
+    con->pending_ops--;
+    if (con->closed && con->pending_ops == 0)
+    {
+        free_client_output(con);
+        con->next_closed = reactor->closed_head;
+        reactor->closed_head = con;
+    }
+}
+
+/* Waits until a non-blocking socket can take more data. Used by the threads
+ * which write to a client's socket themselves */
+static int wait_for_writable(int fd)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    while (poll(&pfd, 1, -1) == -1)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+/* Writes all of 'buf' to a socket, waiting for it if it is non-blocking.
+ * @return -1 if the connection failed */
+int socket_write_all(int fd, const char* buf, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = send(fd, buf, length, MSG_NOSIGNAL);
+        if (written == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (wait_for_writable(fd) == -1)
+                    return -1;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/* sendfile()s 'length' bytes of 'file_fd' starting at 'offset' to a socket,
+ * waiting for it if it is non-blocking.
+ * @return -1 if the connection failed */
+int socket_sendfile_all(int fd, int file_fd, off_t offset,
+                        size_t length)
+{
+    off_t end = offset + length;
+    while (offset < end)
+    {
+        ssize_t sent = sendfile(fd, file_fd, &offset, end - offset);
+        if (sent == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (wait_for_writable(fd) == -1)
+                    return -1;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (sent == 0)
+            return -1; /* File shrunk under us */
+    }
+    return 0;
+}
+
+/* Drops whatever is left in the output queue */
+void free_client_output(epoll_conn_state* con)
+{
+    while (con->out_head != NULL)
+    {
+        output_buffer_t* buf = con->out_head;
+        con->out_head = buf->next;
+        free_output_buffer(buf);
+    }
+    con->out_tail = NULL;
+    con->out_bytes = 0;
 }
 
+/* Admission limits, see server_config_t */
+static int max_connections = INT_MAX;
+static int max_queued_jobs = INT_MAX;
+static atomic_int active_connections = 0;
+static atomic_long shed_connections = 0;
+static atomic_long shed_requests = 0;
+static atomic_long timed_out_connections = 0;
+static atomic_long coalesced_requests = 0;
+
+/* Called by the reactors for every connection cut off by a timeout */
+void increment_timeout_count()
+{
+    atomic_fetch_add_explicit(&timed_out_connections, 1, memory_order_relaxed);
+}
+
+/* Called by the reactors for every request which joined an identical one
+ * in flight instead of running the module */
+void increment_coalesced_count()
+{
+    atomic_fetch_add_explicit(&coalesced_requests, 1, memory_order_relaxed);
+}
+
+void init_admission_control(int connections, int queued_jobs)
+{
+    max_connections = connections;
+    max_queued_jobs = queued_jobs;
+}
 
-void add_worker_fd_to_epoll(int epollfd, int worker_fd, epoll_conn_state* cli_con)
+/* Called by the reactors for every accepted client.
+ * @return 1 if the server takes the connection, 0 if it is over the limit */
+int admit_connection()
 {
+    if (atomic_fetch_add_explicit(&active_connections, 1,
+                                  memory_order_relaxed) >= max_connections)
+    {
+        atomic_fetch_sub_explicit(&active_connections, 1,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&shed_connections, 1, memory_order_relaxed);
+        return 0;
+    }
+    return 1;
+}
+
+void release_connection()
+{
+    atomic_fetch_sub_explicit(&active_connections, 1, memory_order_relaxed);
+}
+
+/* Turns away a client the server has no room for. The 503 is written
+ * without waiting; if the socket doesn't take it, the client just sees the
+ * connection close */
+void reject_connection(int cli_fd)
+{
+    size_t length;
+    const char* response = http_overload_response(0, &length);
+    send(cli_fd, response, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(cli_fd);
+}
+
+/* Called before a dynamic request is handed to the workers. Requests are
+ * turned away while the workers are behind by more than the limit, so
+ * that the ones taken get served in bounded time.
+ * @return 1 if the request may be queued, 0 if it is to be shed */
+int admit_dynamic_request()
+{
+    if (worker_pool_length(lanes[LANE_FAST]) +
+        worker_pool_length(lanes[LANE_SLOW]) >= (size_t)max_queued_jobs)
+    {
+        atomic_fetch_add_explicit(&shed_requests, 1, memory_order_relaxed);
+        return 0;
+    }
+    return 1;
+}
+
+/* Coarse monotonic clock. Good enough for timeouts and cheap enough to
+ * read on every wake up of the event loop */
+uint64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Starts the worker threads running 'func'. The fast lane starts with
+ * 'min_workers', one per core the server may run on when 0, the slow lane
+ * with 'slow_workers', one per SLOW_LANE_CORE_SHARE cores when 0. Each
+ * grows up to 'max_workers', 'per_core' per core when 0. The fast lane
+ * covers every core, so pinning the slow lane's workers would only stack
+ * them on fast workers' cores. They are left to the scheduler instead */
+void init_dynamic_dispatch(int min_workers, int max_workers,
+                           int slow_workers, int per_core,
+                           void* (*func)(void*))
+{
+    int cores = worker_pool_cpu_count();
+    if (min_workers <= 0)
+        min_workers = cores;
+    if (slow_workers <= 0)
+        slow_workers = cores / SLOW_LANE_CORE_SHARE > 0 ?
+                       cores / SLOW_LANE_CORE_SHARE : 1;
+    if (max_workers <= 0)
+        max_workers = cores * per_core;
+    if (max_workers < min_workers)
+        max_workers = min_workers;
+    lanes[LANE_FAST] = worker_pool_create(min_workers, max_workers, 0, func);
+    lanes[LANE_SLOW] = worker_pool_create(slow_workers,
+                                          max_workers > slow_workers ?
+                                          max_workers : slow_workers,
+                                          -1, func);
+    printf("Running %d to %d fast lane and %d to %d slow lane worker(s)\n",
+           min_workers, max_workers, slow_workers,
+           max_workers > slow_workers ? max_workers : slow_workers);
+}
+
+/* Lane of the module the request is for, as last measured. Modules which
+ * haven't run yet go to the fast lane */
+static int dynamic_request_lane(char* resource_name)
+{
+    char lib_path[MAX_MODULE_PATH_LENGTH];
+    format_module_path(lib_path, resource_name);
+    cache_key_t key;
+    init_cache_key(&key, lib_path);
+    int lane = LANE_FAST;
+    cache_read_begin();
+    cache_entry_t* entry = peek_cached_item(cache, &key);
+    if (entry != NULL && atomic_load_explicit(&entry->data->value.slow,
+                                              memory_order_relaxed))
+        lane = LANE_SLOW;
+    cache_read_end();
+    return lane;
+}
+
+/* Sets up a reactor around its listening socket: the epoll instance and the
+ * completion queue through which workers return finished requests. Workers
+ * wake the reactor through an eventfd, which it polls along with the client
+ * sockets. On the io_uring backend, there is no epoll instance; the ring is
+ * set up by the reactor's thread (init_reactor_uring) and reads the eventfd
+ * itself, so the listening socket and the eventfd stay blocking. */
+void init_reactor(reactor_t* reactor, int id, int listen_fd, int max_events,
+                  int backend)
+{
+    reactor->id = id;
+    reactor->backend = backend;
+    reactor->listen_fd = listen_fd;
+    reactor->closed_head = NULL;
+    reactor->now_ms = monotonic_ms();
+    reactor->accept_paused = 0;
+    reactor->accept_retry_ms = 0;
+    timer_wheel_init(&reactor->timers, TIMER_TICK_MS, reactor->now_ms);
+    mem_pool_init(&reactor->conn_pool, sizeof(epoll_conn_state),
+                  POOL_SLAB_OBJECTS);
+    mem_pool_init(&reactor->item_pool, sizeof(request_item),
+                  POOL_SLAB_OBJECTS);
+    memset(reactor->inflight, 0, sizeof(reactor->inflight));
+    reactor->completion_queue = job_queue_create(JOB_QUEUE_CAPACITY);
+    atomic_init(&reactor->completion_signalled, 0);
+    memset(&reactor->listen_state, 0, sizeof(epoll_conn_state));
+    reactor->listen_state.type = EVENT_OWNER_LISTENER;
+    reactor->listen_state.client_fd = reactor->listen_fd;
+    memset(&reactor->completion_state, 0, sizeof(epoll_conn_state));
+    reactor->completion_state.type = EVENT_OWNER_COMPLETION;
+    reactor->epoll_fd = -1;
+    reactor->events = NULL;
+    if (backend == EVENT_BACKEND_URING)
+    {
+        reactor->completion_fd = eventfd(0, EFD_CLOEXEC);
+        if (reactor->completion_fd == -1)
+        {
+            perror("Reactor init");
+            exit(EXIT_FAILURE);
+        }
+        reactor->completion_state.client_fd = reactor->completion_fd;
+        return;
+    }
+
+    make_socket_non_blocking(reactor->listen_fd);
+    reactor->completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    reactor->epoll_fd = epoll_create1(0);
+    if (reactor->completion_fd == -1 || reactor->epoll_fd == -1)
+    {
+        perror("Reactor init");
+        exit(EXIT_FAILURE);
+    }
+    reactor->completion_state.client_fd = reactor->completion_fd;
+
     struct epoll_event event;
-    epoll_conn_state* conn = malloc(sizeof(epoll_conn_state));
-    conn->client_fd = cli_con->client_fd;
-    conn->worker_fd = worker_fd;
-    conn->type = EVENT_OWNER_WORKER;
-    conn->client_con = cli_con;
+    memset(&event, 0, sizeof(event));
+    event.data.ptr = &reactor->listen_state;
+    event.events = EPOLLIN | EPOLLET; /* Edge triggered because we
+                                         want to get notified only
+                                         when a new connection is
+                                         accepted */
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd,
+                  &event) == -1)
+    {
+        perror("Epoll Ctl Add");
+        exit(EXIT_FAILURE);
+    }
 
-    event.data.ptr = conn;
-    event.events = EPOLLIN | EPOLLHUP | EPOLLERR; /* Level triggered
-                                                     Worker generates a lot of
-                                                     output. We won't get all of
-                                                     it in one go */
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, worker_fd, &event) == -1)
+    event.data.ptr = &reactor->completion_state;
+    event.events = EPOLLIN;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->completion_fd,
+                  &event) == -1)
     {
-        perror("epoll add client fd");
+        perror("Epoll Ctl Add");
         exit(EXIT_FAILURE);
     }
+    reactor->events = calloc(max_events, sizeof(struct epoll_event));
 }
 
+/* Hands the request over to a worker thread.
+ * @return 0 on success, -1 if the workers are backed up */
 int send_to_worker_thread(request_item* reqitem)
 {
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
+    reqitem->dispatched_ms = monotonic_ms();
+    worker_pool_t* lane = lanes[dynamic_request_lane(reqitem->resource_name)];
+    if (worker_pool_submit(lane, reqitem) == JOB_QUEUE_FULL)
     {
-        perror("ERROR opening socket");
+        dbg_printf("Job queue is full\n");
+        return -1;
     }
-    struct sockaddr_in serv_addr;
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(WORKER_THREAD_PORT);
-    if(inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr)<=0)
+    return 0;
+}
+
+/* Called by worker threads. Blocks until there is a request to serve.
+ * @return NULL if the worker is no longer needed */
+request_item* receive_from_master(worker_t* worker)
+{
+    request_item* item = worker_pool_take(worker);
+    if (item != NULL)
+        worker_pool_record_wait(worker->pool,
+                                monotonic_ms() - item->dispatched_ms);
+    return item;
+}
+
+/* Called by worker threads once the request is served. The request goes
+ * back to the reactor which owns the connection. Only the first completion
+ * after the reactor drained its queue writes to the eventfd */
+void send_completion_to_master(request_item* reqitem)
+{
+    reactor_t* reactor = reqitem->reactor;
+    while (job_queue_push(reactor->completion_queue, reqitem) == JOB_QUEUE_FULL)
     {
-        dbg_printf("inet_pton error occured\n");
-        return -1;
+        /* Reactor is behind on completions. Let it catch up */
+        sched_yield();
     }
-    if (connect(sockfd, (struct sockaddr*) &serv_addr, sizeof(serv_addr)) == -1)
+    if (atomic_exchange(&reactor->completion_signalled, 1) == 0)
     {
-        perror("Connect to worker thread");
-        return -1;
+        uint64_t one = 1;
+        if (write(reactor->completion_fd, &one, sizeof(one)) == -1 &&
+            errno != EAGAIN)
+            perror("Completion eventfd write");
     }
-    int a = rio_writen(sockfd, reqitem, sizeof(request_item));
-    return sockfd;
 }
 
-/* All worker threads increment this. */
+/* Called by the reactor when its completion eventfd is readable. The signal
+ * flag is cleared before the queue is drained, so a completion pushed after
+ * this point will signal again */
+void acknowledge_completions(reactor_t* reactor)
+{
+    uint64_t count;
+    if (read(reactor->completion_fd, &count, sizeof(count)) == -1 &&
+        errno != EAGAIN)
+        perror("Completion eventfd read");
+    reset_completion_signal(reactor);
+}
+
+/* On the io_uring backend, the eventfd was already read by the ring */
+void reset_completion_signal(reactor_t* reactor)
+{
+    atomic_store(&reactor->completion_signalled, 0);
+}
+
+/* Called by the reactor. @return next finished request or NULL */
+request_item* receive_completion(reactor_t* reactor)
+{
+    return job_queue_pop(reactor->completion_queue);
+}
+
+/* Called by the reactor owning the request, which is the only thread
+ * touching its item pool */
+void free_request_item(request_item* item)
+{
+    free(item->response);
+    mem_pool_free(&item->reactor->item_pool, item);
+}
+
+/* All reactor and worker threads increment this. */
 void increment_reply_count()
 {
-    pthread_mutex_lock(&replycnt_mutex);
-    reply_cnt++;
-    pthread_mutex_unlock(&replycnt_mutex);
+    atomic_fetch_add_explicit(&reply_cnt, 1, memory_order_relaxed);
 }
 
-/* All worker threads use this. */
 long get_reply_count()
 {
-    pthread_mutex_lock(&replycnt_mutex);
-    int res = (reply_cnt);
-    pthread_mutex_unlock(&replycnt_mutex);
-    return res;
+    return atomic_load_explicit(&reply_cnt, memory_order_relaxed);
 }
 
-/* Only main thread increments this. No mutex required */
 long get_request_count()
 {
-    return request_cnt;
+    return atomic_load_explicit(&request_cnt, memory_order_relaxed);
 }
 
-/* Only main thread increments this. No mutex required */
+/* All reactor threads increment this. */
 void increment_request_count()
 {
-    request_cnt++;
+    atomic_fetch_add_explicit(&request_cnt, 1, memory_order_relaxed);
 }
 
+/* @return 1 if the file of a cached module was replaced, touched or
+ * removed since it was loaded */
+static int module_changed(cache_entry_t* entry)
+{
+    struct stat st;
+    cache_value_t* value = &entry->data->value;
+    if (stat(entry->data->key.key_data, &st) == -1)
+        return 1;
+    return st.st_dev != value->dev || st.st_ino != value->ino ||
+           st.st_mtim.tv_sec != value->mtime.tv_sec ||
+           st.st_mtim.tv_nsec != value->mtime.tv_nsec;
+}
+
+/* Reloads the module at 'path' if it is cached and its file changed. The
+ * new version is loaded with no lock held, then swapped in for new
+ * requests at once. The old one is unloaded by a later reclaim_cache once
+ * the requests running it are done, so a long request never holds up the
+ * next reload. A module whose file is gone is dropped, and one whose new
+ * file can't be loaded yet, for example while it is being written, is
+ * kept until a loadable version shows up */
+static void revalidate_module(char* path)
+{
+    cache_key_t key;
+    init_cache_key(&key, path);
+    get_cache_shard_wrlock(cache, &key);
+    cache_entry_t* entry = peek_cached_item(cache, &key);
+    int changed = (entry != NULL && module_changed(entry));
+    release_cache_shard_wrlock(cache, &key);
+    if (!changed)
+        return;
+
+    struct stat st;
+    cache_entry_t* replacement = NULL;
+    if (stat(path, &st) == 0)
+    {
+        replacement = create_library_entry(&key, eager_module_loading);
+        if (replacement == NULL)
+            return;
+    }
+    get_cache_shard_wrlock(cache, &key);
+    cache_entry_t* current = peek_cached_item(cache, &key);
+    if (current != NULL && replacement != NULL)
+    {
+        printf("CACHE REVALIDATION THREAD: Refreshed %s\n", path);
+        replace_cache_entry(cache, current, replacement);
+        replacement = NULL;
+    }
+    else if (current != NULL)
+    {
+        printf("CACHE REVALIDATION THREAD: Dropped %s\n", path);
+        remove_cache_entry(cache, current);
+    }
+    release_cache_shard_wrlock(cache, &key);
+    if (replacement != NULL)
+        free_library_entry(replacement); /* Evicted meanwhile */
+}
+
+static void revalidate_all_modules()
+{
+    /* Collect the names first, reloading can't be done with the lock */
+    int count = 0, i;
+    get_global_cache_wrlock(cache);
+    cache_entry_t* entry;
+    for (entry = cache_first_entry(cache); entry;
+         entry = cache_next_entry(cache, entry))
+        count++;
+    char** paths = (char**)Malloc((count + 1) * sizeof(char*));
+    for (i = 0, entry = cache_first_entry(cache); entry;
+         entry = cache_next_entry(cache, entry))
+        paths[i++] = strdup(entry->data->key.key_data);
+    release_global_cache_wrlock(cache);
+    for (i = 0; i < count; i++)
+    {
+        revalidate_module(paths[i]);
+        Free(paths[i]);
+    }
+    Free(paths);
+}
+
+/* Watches the cgi-bin directory and reloads a cached module as soon as
+ * its file is written, replaced, touched or removed. If inotify is not
+ * available, all the modules are checked every CACHE_REVALIDATION_TIMEOUT
+ * seconds instead */
 void* cache_revalidation_thread(void* arg)
 {
     if (pthread_detach(pthread_self()) == -1)
@@ -352,42 +1590,261 @@ void* cache_revalidation_thread(void* arg)
         perror("Thread cannot be detached");
         return (void*)-1;
     }
-    while(1)
+    int watch_fd = inotify_init1(IN_CLOEXEC);
+    if (watch_fd == -1 || inotify_add_watch(watch_fd, CGIBIN_DIR_NAME,
+                    IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                    IN_DELETE | IN_ATTRIB) == -1)
     {
-        printf("CACHE REVALIDATION THREAD INVOKED\n");
-        get_global_cache_wrlock(cache);
-        /* Go through all the entries and check if the underlying
-         * file is changed */
-        cache_entry_t* entry = cache->head;
-        struct stat st;
-        while (entry)
+        perror("inotify");
+        printf("Checking modules every %d seconds\n",
+               CACHE_REVALIDATION_TIMEOUT);
+        while (1)
         {
-            if (stat(entry->data->key.key_data, &st) == -1)
-            {
-                perror("Stat");
-                printf("Library is no longer present. Cannot update..Using stale version");
-            }
-            /* Assumption: If the file size is changed, then probably it is modified.
-             * There are cases when its modified and file size doesn't change.
-             * Need to improve using last modified timestamps */
-            if (entry->data_size != st.st_size)
+            revalidate_all_modules();
+            reclaim_cache(cache);
+            sleep(CACHE_REVALIDATION_TIMEOUT);
+        }
+    }
+
+    char buf[MODULE_WATCH_BUFFER_LENGTH]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd watch = {.fd = watch_fd, .events = POLLIN};
+    while (1)
+    {
+        /* Every wake-up, by an event or the timeout, frees the modules
+         * unloaded earlier whose requests have finished since */
+        int ready = poll(&watch, 1, MODULE_RECLAIM_INTERVAL_MS);
+        reclaim_cache(cache);
+        if (ready == 0 || (ready == -1 && errno == EINTR))
+            continue;
+        ssize_t length = read(watch_fd, buf, sizeof(buf));
+        if (length <= 0)
+        {
+            if (length == -1 && errno == EINTR)
+                continue;
+            perror("Reading module events");
+            exit(EXIT_FAILURE);
+        }
+        char* ptr = buf;
+        while (ptr < buf + length)
+        {
+            struct inotify_event* event = (struct inotify_event*)ptr;
+            if (event->mask & IN_Q_OVERFLOW)
+                revalidate_all_modules(); /* Events were lost */
+            else if (event->len > 0)
             {
-                printf("CACHE REVALIDATION THREAD: Refreshed %s\n", entry->data->key.key_data);
-                /* Needs sync */
-                unload_dyn_library(entry->data->value.value_data);
-                void* handle = dlopen(entry->data->key.key_data, RTLD_LAZY);
-                if (!handle)
-                {
-                    fprintf(stderr, "%s\n", dlerror());
-                }
-                entry->data->value.value_data = handle;
-                entry->data_size = st.st_size;
+                int path_len = strlen(CGIBIN_DIR_NAME) + event->len +
+                               MAX_PATH_CHARS;
+                char lib_path[path_len];
+                snprintf(lib_path, path_len, "./%s/%s", CGIBIN_DIR_NAME,
+                         event->name);
+                revalidate_module(lib_path);
             }
-            entry = entry->next;
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+/* Modules found by preload_modules, shared by the preloading threads */
+typedef struct preload_list
+{
+    char** paths;
+    int count;
+    atomic_int next; /* Index of the next module to be loaded */
+    atomic_int loaded;
+}preload_list_t;
+
+static double elapsed_ms(struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 +
+           (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Takes modules off the list until there are none left, and caches each
+ * one fully bound and paged in */
+static void* preload_thread(void* arg)
+{
+    preload_list_t* list = (preload_list_t*)arg;
+    int i;
+    while ((i = atomic_fetch_add(&list->next, 1)) < list->count)
+    {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        cache_key_t key;
+        init_cache_key(&key, list->paths[i]);
+        cache_entry_t* entry = create_library_entry(&key, 1);
+        if (entry == NULL)
+        {
+            fprintf(stderr, "Cannot preload %s\n", list->paths[i]);
+            continue;
+        }
+        get_cache_shard_wrlock(cache, &key);
+        if (peek_cached_item(cache, &key) == NULL &&
+            add_to_cache(cache, entry) != CACHE_INSERT_ERR)
+            entry = NULL;
+        release_cache_shard_wrlock(cache, &key);
+        if (entry != NULL)
+        {
+            printf("Cannot insert %s into cache\n", list->paths[i]);
+            free_library_entry(entry);
+            continue;
+        }
+        atomic_fetch_add(&list->loaded, 1);
+        printf("Preloaded %s in %.2f ms\n", list->paths[i],
+               elapsed_ms(&start));
+    }
+    return NULL;
+}
+
+/* Loads every module of the cgi-bin directory into the cache, with
+ * PRELOAD_THREAD_COUNT threads. Called before the server starts listening,
+ * so no first request pays for loading, symbol binding or page faults.
+ * Modules reloaded later on are bound and paged in eagerly as well */
+void preload_modules()
+{
+    eager_module_loading = 1;
+    DIR* dir = opendir(CGIBIN_DIR_NAME);
+    if (dir == NULL)
+    {
+        perror("Preloading modules");
+        return;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    preload_list_t list;
+    int capacity = 0;
+    list.paths = NULL;
+    list.count = 0;
+    struct dirent* dirent;
+    while ((dirent = readdir(dir)) != NULL)
+    {
+        /* Same path as the requests look modules up by */
+        size_t length = strlen(dirent->d_name);
+        if (length <= strlen(".so") ||
+            strcmp(dirent->d_name + length - strlen(".so"), ".so") != 0)
+            continue;
+        if (list.count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            list.paths = (char**)Realloc(list.paths,
+                                         capacity * sizeof(char*));
         }
-        release_global_cache_wrlock(cache);
-        sleep(CACHE_REVALIDATION_TIMEOUT);
+        int path_len = strlen(CGIBIN_DIR_NAME) + length + MAX_PATH_CHARS;
+        list.paths[list.count] = (char*)Malloc(path_len);
+        snprintf(list.paths[list.count++], path_len, "./%s/%s",
+                 CGIBIN_DIR_NAME, dirent->d_name);
     }
+    closedir(dir);
+    atomic_init(&list.next, 0);
+    atomic_init(&list.loaded, 0);
+
+    int thread_count = list.count < PRELOAD_THREAD_COUNT ?
+                                        list.count : PRELOAD_THREAD_COUNT;
+    pthread_t threads[PRELOAD_THREAD_COUNT];
+    int i;
+    for (i = 0; i < thread_count; i++)
+        Pthread_create(&threads[i], NULL, preload_thread, &list);
+    for (i = 0; i < thread_count; i++)
+        Pthread_join(threads[i], NULL);
+    printf("Preloaded %d of %d module(s) in %.2f ms\n",
+           atomic_load(&list.loaded), list.count, elapsed_ms(&start));
+    for (i = 0; i < list.count; i++)
+        Free(list.paths[i]);
+    Free(list.paths);
+}
+
+/* Reactors whose pools are reported by the statistics thread */
+static reactor_t* stat_reactors;
+static int stat_reactor_count;
+
+void set_stat_reactors(reactor_t* reactors, int count)
+{
+    stat_reactors = reactors;
+    stat_reactor_count = count;
+}
+
+/* Prints objects in use / objects allocated of every reactor's pools */
+static void print_pool_stats()
+{
+    int i;
+    for (i = 0; i < stat_reactor_count; i++)
+    {
+        reactor_t* reactor = &stat_reactors[i];
+        printf("REACTOR %d POOLS CONN: %zu/%zu\tITEM: %zu/%zu\n", reactor->id,
+               mem_pool_in_use(&reactor->conn_pool),
+               mem_pool_capacity(&reactor->conn_pool),
+               mem_pool_in_use(&reactor->item_pool),
+               mem_pool_capacity(&reactor->item_pool));
+    }
+}
+
+/* Prints how many workers each lane has, how busy they are, how much
+ * work they stole and how the lanes were resized. Then the modules served
+ * by the slow lane, with their average run time */
+static void print_worker_stats()
+{
+    int lane;
+    for (lane = 0; lane < LANE_COUNT; lane++)
+    {
+        worker_pool_stats_t stats;
+        get_worker_pool_stats(lanes[lane], &stats);
+        printf("%s LANE WORKERS: %d (%d-%d)\tBUSY: %d\tQUEUED: %zu\t"
+               "WAIT(ms): %.1f\tRUN: %ld\tSTOLEN: %ld\tPARKED: %ld\t"
+               "GROWN: %ld\tRETIRED: %ld\n", lane_names[lane],
+               stats.workers, stats.min_workers, stats.max_workers,
+               stats.busy, worker_pool_length(lanes[lane]),
+               stats.wait_us / 1000.0, stats.executed, stats.stolen,
+               stats.parks, stats.grown, stats.retired);
+    }
+
+    /* The names are copied under the lock and printed after it, so loads
+     * of modules never wait on stdout */
+    char slow[SLOW_LANE_REPORT_LENGTH];
+    size_t used = 0;
+    int fast = 0;
+    slow[0] = '\0';
+    get_global_cache_wrlock(cache);
+    cache_entry_t* entry;
+    for (entry = cache_first_entry(cache); entry;
+         entry = cache_next_entry(cache, entry))
+    {
+        cache_value_t* value = &entry->data->value;
+        if (!atomic_load_explicit(&value->slow, memory_order_relaxed))
+            fast++;
+        else if (used < sizeof(slow))
+            used += snprintf(slow + used, sizeof(slow) - used,
+                             " %s (%.2f ms)", entry->data->key.key_data,
+                             atomic_load_explicit(&value->runtime_us,
+                                                  memory_order_relaxed) /
+                             1000.0);
+    }
+    release_global_cache_wrlock(cache);
+    printf("SLOW LANE (over %.1f ms, back under %.1f ms):%s\tFAST: %d "
+           "module(s)\n", SLOW_LANE_THRESHOLD_US / 1000.0,
+           FAST_LANE_THRESHOLD_US / 1000.0, slow, fast);
+}
+
+static void print_hit_ratio(const char* name, cache_stats_t* stats)
+{
+    long lookups = stats->hits + stats->misses;
+    printf("%s (%s) HIT: %ld\tMISS: %ld\tHIT RATIO: %.1f%%\t"
+           "EVICTED: %ld\tREJECTED: %ld\n", name,
+           cache_policy_name(cache->policy), stats->hits, stats->misses,
+           lookups ? 100.0 * stats->hits / lookups : 0.0,
+           stats->evictions, stats->rejections);
+}
+
+/* Prints the hit ratio of the module and response caches and how many
+ * entries they let go */
+static void print_cache_stats()
+{
+    cache_stats_t stats;
+    get_cache_stats(cache, &stats);
+    print_hit_ratio("CACHE", &stats);
+    get_response_cache_stats(&stats);
+    print_hit_ratio("RESPONSE CACHE", &stats);
 }
 
 /* This presents the connection rate and other server performance metrics
@@ -404,24 +1861,31 @@ void* statistics_thread(void* arg)
     int last_requests = 0;
     while (1)
     {
-        long replys = get_reply_count(&reply_cnt, &replycnt_mutex);
-        long requests = request_cnt;
+        long replys = get_reply_count();
+        long requests = get_request_count();
         printf("REQ: %ld\tREP: %ld\tREQ_Rate(/sec):%ld \tREP_Rate(/sec):%ld \n",
-                requests, replys, (replys - last_replys) / STAT_INTERVAL,
-                                    (requests - last_requests) / STAT_INTERVAL);
+                requests, replys, (requests - last_requests) / STAT_INTERVAL,
+                                    (replys - last_replys) / STAT_INTERVAL);
         last_replys = replys;
         last_requests = requests;
+        printf("CONN: %d\tSHED CONN: %ld\tSHED REQ: %ld\tTIMED OUT: %ld\t"
+               "COALESCED: %ld\n",
+               atomic_load_explicit(&active_connections, memory_order_relaxed),
+               atomic_load_explicit(&shed_connections, memory_order_relaxed),
+               atomic_load_explicit(&shed_requests, memory_order_relaxed),
+               atomic_load_explicit(&timed_out_connections,
+                                    memory_order_relaxed),
+               atomic_load_explicit(&coalesced_requests,
+                                    memory_order_relaxed));
+        print_pool_stats();
+        print_worker_stats();
+        print_cache_stats();
         sleep(STAT_INTERVAL);
     }
 }
 
 void create_stat_thread()
 {
-    if (pthread_mutex_init(&replycnt_mutex, NULL) != 0)
-    {
-        perror("mutex init");
-        exit(EXIT_FAILURE);
-    }
     create_threads(1, statistics_thread);
 }
 
@@ -459,9 +1923,10 @@ void Pthread_rwlock_unlock(pthread_rwlock_t* lock)
 }
 
 
-void init_cache()
+void init_cache(int policy)
 {
-    cache = get_new_cache();
+    cache = get_new_cache(MAX_CACHE_SIZE, policy, CACHE_DEFAULT_SHARDS);
+    init_response_cache(policy);
     /* Start up cache revalidation thread */
     create_threads(1, cache_revalidation_thread);
 }
@@ -4,18 +4,46 @@
 #include "http_util.h"
 #include <pthread.h>
 #include "csapp.h"
+#include "job_queue.h"
+#include "worker_pool.h"
+#include "mem_pool.h"
+#include "uring.h"
+#include "timer_wheel.h"
 
 #define STAT_INTERVAL               5 /* Display interval for statistics */
-#define CACHE_REVALIDATION_TIMEOUT  60
+#define CACHE_REVALIDATION_TIMEOUT  60 /* Only used without inotify */
+#define MODULE_WATCH_BUFFER_LENGTH  4096
+#define MODULE_RECLAIM_INTERVAL_MS  1000 /* How often the watcher frees the
+                                            modules unloaded meanwhile */
+#define PRELOAD_THREAD_COUNT        4 /* Threads loading the modules when
+                                           they are preloaded at startup */
 
 #define EVENT_OWNER_CLIENT          1
-#define EVENT_OWNER_WORKER          2
+#define EVENT_OWNER_LISTENER        2
+#define EVENT_OWNER_COMPLETION      3
 
 #define MAX_RESOURCE_NAME_LENGTH    100
-#define WORKER_THREAD_PORT          9898 /* All of the worker threads listen
-                                            on this port. Kernel dynamically
-                                            load balances master's request
-                                            between worker threads */
+#define LANE_FAST                   0 /* Worker pools. Modules running */
+#define LANE_SLOW                   1 /* long get workers of their own */
+#define LANE_COUNT                  2
+#define SLOW_LANE_THRESHOLD_US      2000 /* Modules running longer on
+                                            average move to the slow lane */
+#define FAST_LANE_THRESHOLD_US      1000 /* and back once they run shorter */
+#define RUNTIME_EWMA_SHIFT          2 /* A new run weighs 1/4 in the
+                                         average run time of a module */
+#define SLOW_LANE_CORE_SHARE        4 /* Slow lane keeps a worker per this
+                                         many cores by default */
+#define SLOW_LANE_REPORT_LENGTH     4096 /* Room for the slow modules in
+                                            the statistics. Cut off past it */
+#define INFLIGHT_TABLE_SIZE         256 /* Buckets of a reactor's table of
+                                           coalesced requests in flight. A
+                                           power of two */
+#define JOB_QUEUE_CAPACITY          65536 /* Max finished requests waiting
+                                             for their reactor */
+#define POOL_SLAB_OBJECTS           256 /* Connection states and request
+                                             items are allocated from per
+                                             reactor pools this many at a
+                                             time */
 
 #define MAX_PATH_CHARS              10 /* Path name characters
                                           ex /cgi-bin/cmu.jpg has 2 path chars
@@ -23,20 +51,80 @@
 #define CGIBIN_DIR_NAME             "cgi-bin"
 #define STATIC_DIR_NAME             "static"
 #define MAX_READ_LENGTH             4096 /* Max read size in single IO request*/
+#define MAX_REQUEST_BUFFER_LENGTH   8192 /* Per connection input buffer. A
+                                            request header has to fit in */
 
 /* Path name size of dynamic request urls */
 #define MAX_DLL_NAME_LENGTH         20
 #define MAX_DLL_PATH_LENGTH         20
+#define MAX_MODULE_PATH_LENGTH      (MAX_RESOURCE_NAME_LENGTH + \
+                                     sizeof(CGIBIN_DIR_NAME) + \
+                                     MAX_PATH_CHARS) /* ./cgi-bin/<name>.so
+                                                        of any resource */
 
 #define RESPONSE_HANDLING_COMPLETE  1
 #define RESPONSE_HANDLING_PARTIAL   2
 
+/* Per connection output queue limits. A connection stops serving further
+ * requests while more than the high water mark is waiting to be written,
+ * and resumes when the client has drained it below the low water mark */
+#define OUTPUT_HIGH_WATER_MARK      (256 * 1024)
+#define OUTPUT_LOW_WATER_MARK       (64 * 1024)
+#define MAX_OUTPUT_IOVECS           16 /* Buffers written per system call */
+
+/* Connection timeouts in milliseconds. Each deadline starts when the
+ * connection starts waiting for the thing it times */
+#define TIMER_TICK_MS               100
+#define IDLE_TIMEOUT_MS             15000 /* Waiting for the next request */
+#define HEADER_READ_TIMEOUT_MS      10000 /* Waiting for the rest of a
+                                             request header */
+#define WORKER_TIMEOUT_MS           30000 /* Waiting for a worker */
+#define FLUSH_TIMEOUT_MS            30000 /* Waiting for the client to take
+                                             more of the output */
+#define ACCEPT_RETRY_MS             100 /* Pause of accepting after
+                                           running out of descriptors */
+#define CONNECTION_FD_RESERVE       256 /* Descriptors the connection limit
+                                           leaves to the listening sockets,
+                                           memfds, modules and static
+                                           files */
+#define TIMER_PHASE_NONE            0
+#define TIMER_PHASE_IDLE            1
+#define TIMER_PHASE_HEADER          2
+#define TIMER_PHASE_WORKER          3
+#define TIMER_PHASE_FLUSH           4
+
 /* Indicates if a socket is shared between multiple threads */
 #define SHARED_SOCKET               1
 #define NON_SHARED_SOCKET           2
 
 #define SERVER_REQUIRED_CMD_ARG_COUNT 2
 
+/* How dynamic responses reach the client */
+#define DISPATCH_MODE_RELAY         1 /* Worker hands the output to the
+                                         reactor, which writes it */
+#define DISPATCH_MODE_DIRECT        2 /* Worker writes to the client's
+                                         socket itself */
+
+/* How a reactor waits for IO */
+#define EVENT_BACKEND_EPOLL         1 /* Readiness with epoll, followed by
+                                         the IO system calls */
+#define EVENT_BACKEND_URING         2 /* IO submitted to and completed by
+                                         an io_uring */
+#define URING_ENTRIES               4096 /* Submission queue size */
+#define URING_BUFFER_COUNT          4096 /* Provided receive buffers of
+                                            MAX_READ_LENGTH per reactor.
+                                            Power of two */
+#define URING_BUFFER_GROUP          0
+
+/* Operations in flight on an io_uring, stored in the tag bits of the
+ * submission's user_data next to the epoll_conn_state pointer */
+#define URING_OP_ACCEPT             1
+#define URING_OP_RECV               2
+#define URING_OP_SEND               3
+#define URING_OP_CLOSE              4
+#define URING_OP_CANCEL             5
+#define URING_OP_COMPLETION         6
+
 //#define DEBUG
 #ifdef DEBUG
 #define dbg_printf(...) printf(__VA_ARGS__)
@@ -44,51 +132,217 @@
 #define dbg_printf(...)
 #endif
 
+/* A chunk of response waiting to be written to a client */
+typedef struct output_buffer
+{
+    char* data; /* Owned by the buffer, unless it is a static reply */
+    int owned;
+    void (*release)(char* data); /* Called instead of freeing data shared
+                                    with others */
+    size_t length;
+    size_t offset; /* Bytes already written */
+    struct output_buffer* next;
+}output_buffer_t;
+
 typedef struct epoll_conn_state
 {
     int type; /* Who is owner of this state */
     int client_fd;
-    int worker_fd; /* Assigned workerfd for the client's fd */
-    struct epoll_conn_state* client_con;
-    /* client_con is required because when workerfd is done, master gets a
-     * notification. Master then takes the output from worker fd and writes
-     * it to the client's fd and closes it.
-     * Now, we also need to free client's epoll_conn_state which was added earlier.
-     * To do the same, we need to have a pointer to clientfd's epoll_con_state
-     * in the workerfd's epoll_con_state */
+    char in_buf[MAX_REQUEST_BUFFER_LENGTH]; /* Read buffer. Survives across
+                                               requests so that pipelined
+                                               requests read in one go are
+                                               not lost */
+    size_t in_length;
+    http_parser_t parser; /* Parser state of the request in in_buf */
+    http_header_t header; /* Request being parsed */
+    int busy; /* A request of this connection is being served by a worker.
+                 Responses go out in order, so the next request waits */
+    int read_pending; /* Socket may have input which is not read yet */
+    int read_eof; /* Client closed its side of the connection */
+    int hangup; /* Client went away while busy */
+    output_buffer_t* out_head; /* Responses not yet taken by the socket */
+    output_buffer_t* out_tail;
+    size_t out_bytes;
+    int paused; /* Output went past the high water mark */
+    int close_after_flush; /* Close once the output queue is empty */
+    struct request_item* deferred; /* Request which writes to the socket
+                                      itself, waiting for the output queue
+                                      to drain */
+    timer_entry_t timer; /* Deadline of the current phase */
+    int timer_phase; /* TIMER_PHASE_* the deadline is for */
+    int output_progress; /* Client took some output since the deadline was
+                            set */
+    int closed; /* Closed, but events for it may still be in the batch
+                   returned by epoll_wait */
+    struct epoll_conn_state* next_closed;
+    /* io_uring backend only. The state is freed once no operation on it is
+     * in flight. The send's iovecs have to live until it completes */
+    int pending_ops;
+    int recv_armed;
+    int send_inflight;
+    int closing; /* Close is submitted, linked behind the last send */
+    struct msghdr send_msg;
+    struct iovec send_iov[MAX_OUTPUT_IOVECS];
 }epoll_conn_state;
 
-/* Structure to pass information between master and worker threads */
+/* An event loop. Every reactor thread has its own listening socket (shared
+ * through SO_REUSEPORT), epoll instance and completion queue, so reactors
+ * never touch each other's connections */
+typedef struct reactor
+{
+    int id;
+    int listen_fd;
+    int epoll_fd;
+    int completion_fd; /* eventfd written by workers on completion */
+    job_queue_t* completion_queue;
+    atomic_int completion_signalled;
+    epoll_conn_state listen_state; /* epoll data for the listening socket */
+    epoll_conn_state completion_state; /* epoll data for the eventfd */
+    struct epoll_event* events;
+    epoll_conn_state* closed_head; /* Freed after the current batch */
+    mem_pool_t conn_pool; /* epoll_conn_state of the clients */
+    mem_pool_t item_pool; /* request_item of the requests in flight */
+    int backend; /* EVENT_BACKEND_EPOLL or EVENT_BACKEND_URING */
+    timer_wheel_t timers; /* Connection timeouts */
+    uint64_t now_ms; /* Time of the last wake up */
+    uring_t ring;
+    uint64_t completion_count; /* Target of the eventfd read on the ring */
+    int accept_paused; /* Ran out of descriptors and hasn't accepted since */
+    uint64_t accept_retry_ms; /* Next try while paused, 0 if none is due */
+    struct request_item* inflight[INFLIGHT_TABLE_SIZE]; /* Dynamic requests
+                                    being run, which identical ones join */
+}reactor_t;
+
+/* Command line configuration of the server */
+typedef struct server_config
+{
+    int port;
+    int reactor_count;
+    int dispatch_mode; /* DISPATCH_MODE_RELAY or DISPATCH_MODE_DIRECT */
+    int backend; /* EVENT_BACKEND_EPOLL or EVENT_BACKEND_URING */
+    int max_connections; /* Clients past this get a 503 and are closed */
+    int max_queued_jobs; /* Dynamic requests past this many waiting for a
+                            worker get a 503 */
+    int preload; /* Load all modules before listening */
+    int cache_policy; /* CACHE_POLICY_CLOCK or CACHE_POLICY_TINYLFU */
+    int min_workers; /* Dynamic content workers kept. 0 for one per core */
+    int max_workers; /* The pool grows up to this many. 0 for a default
+                        per core */
+    int slow_workers; /* Kept by the slow lane. 0 for a default per core */
+    int coalesce; /* Identical dynamic requests in flight share one run */
+}server_config_t;
+
+/* Structure to pass information between master and worker threads.
+ * The master pushes it onto the job queue, the worker fills in the response
+ * and pushes it back onto the completion queue */
 typedef struct request_item
 {
+    int resource_type; /* RESOURCE_TYPE_CGI_BIN or one of the static types */
+    int keep_alive; /* Connection stays open after the response */
+    int direct; /* Worker writes the response to client_fd itself */
     char resource_name[MAX_RESOURCE_NAME_LENGTH];
     int client_fd; /* Required to perform sendfile directly for STATIC request type*/
+    epoll_conn_state* con; /* Client connection waiting for this request */
+    reactor_t* reactor; /* Reactor owning the connection */
+    char* response; /* Generated content. Owned by the item */
+    size_t response_length;
+    uint64_t dispatched_ms; /* Handed to the workers */
+    int status; /* Of the generated response */
+    size_t header_length; /* Of the response. The content follows */
+    int coalesce; /* Tracked in the reactor's in-flight table */
+    struct request_item* followers; /* Identical requests waiting for the
+                                       response of this one */
+    struct request_item* next; /* In the in-flight table's bucket, or in
+                                  the followers of the request run */
 }request_item;
 
+/* Content of a coalesced response, shared by the output queues of all the
+ * clients which asked for it. Only their reactor touches it */
+typedef struct shared_response
+{
+    int refs;
+    char body[];
+}shared_response_t;
+
 /* Request handling */
-request_item* create_dynamic_request_item(char* name);
-request_item* create_static_request_item(char* name, int client_fd);
+request_item* create_dynamic_request_item(reactor_t* reactor, char* name);
+request_item* create_static_request_item(reactor_t* reactor, char* name,
+                                        int client_fd);
 void handle_static(int fd, char* resource_name);
 void handle_unknown(int fd, char* resource_name);
-void create_static_worker(int client_fd, void* (*func)(void*), char* res_name);
+int handle_static_request(request_item* item);
+void create_static_worker(request_item* item, void* (*func)(void*));
+request_item* find_inflight_request(reactor_t* reactor, char* name);
+void track_inflight_request(reactor_t* reactor, request_item* item);
+void untrack_inflight_request(reactor_t* reactor, request_item* item);
 
 /* Epoll */
-void add_worker_fd_to_epoll(int epollfd, int worker_fd, epoll_conn_state*);
-void add_client_fd_to_epoll(int epollfd, int cli_fd);
-int send_to_worker_thread(request_item* reqitem);
+epoll_conn_state* add_client_fd_to_epoll(reactor_t* reactor, int cli_fd);
+epoll_conn_state* add_client_fd_to_uring(reactor_t* reactor, int cli_fd);
+void free_client_connection(reactor_t* reactor, epoll_conn_state* con);
+void queue_client_output(epoll_conn_state* con, char* data, size_t length);
+void queue_client_static_output(epoll_conn_state* con, const char* data,
+                                size_t length);
+void queue_client_shared_output(epoll_conn_state* con, char* data,
+                                size_t length, void (*release)(char* data));
+int flush_client_output(epoll_conn_state* con);
+void consume_client_output(epoll_conn_state* con, size_t written);
+void free_client_output(epoll_conn_state* con);
+int read_client_input(epoll_conn_state* con);
+int socket_write_all(int fd, const char* buf, size_t length);
+int socket_sendfile_all(int fd, int file_fd, off_t offset, size_t length);
 int create_listen_tcp_socket(int port, int backlog, int socket_shared);
 
+/* io_uring backend */
+void init_reactor_uring(reactor_t* reactor);
+void uring_arm_accept(reactor_t* reactor);
+void uring_arm_completion(reactor_t* reactor);
+void uring_arm_client_recv(reactor_t* reactor, epoll_conn_state* con);
+int uring_receive_client_input(reactor_t* reactor, epoll_conn_state* con,
+                               int res, unsigned flags);
+void uring_submit_client_output(reactor_t* reactor, epoll_conn_state* con);
+void uring_close_client(reactor_t* reactor, epoll_conn_state* con);
+void uring_complete_op(reactor_t* reactor, epoll_conn_state* con);
+
+void init_reactor(reactor_t* reactor, int id, int listen_fd, int max_events,
+                  int backend);
+
+/* Admission control */
+void init_admission_control(int max_connections, int max_queued_jobs);
+int admit_connection();
+void release_connection();
+void reject_connection(int cli_fd);
+int admit_dynamic_request();
+
+/* Master <-> worker communication */
+void init_dynamic_dispatch(int min_workers, int max_workers,
+                           int slow_workers, int per_core,
+                           void* (*func)(void*));
+int send_to_worker_thread(request_item* reqitem);
+request_item* receive_from_master(worker_t* worker);
+void send_completion_to_master(request_item* reqitem);
+request_item* receive_completion(reactor_t* reactor);
+void acknowledge_completions(reactor_t* reactor);
+void reset_completion_signal(reactor_t* reactor);
+void free_request_item(request_item* item);
+
 /* Misc */
 int create_threads(int no_threads, void* (*func)(void*));
-void init_stat_mutexes();
 int parse_port_number(int argc, char* argv);
+void parse_server_args(int argc, char* argv[], server_config_t* config);
 int increase_fd_limit(int max_fd_limit);
+int connection_fd_limit(int fd_limit);
 int make_socket_non_blocking(int fd);
+int create_memory_fd(const char* name);
 void increment_request_count();
 void increment_reply_count();
 long get_reply_count();
 long get_request_count();
+void increment_timeout_count();
+void increment_coalesced_count();
+uint64_t monotonic_ms();
 void create_stat_thread();
+void set_stat_reactors(reactor_t* reactors, int count);
 
 /* Locking */
 void Pthread_rwlock_rdlock(pthread_rwlock_t* lock);
@@ -96,7 +350,11 @@ void Pthread_rwlock_wrlock(pthread_rwlock_t* lock);
 void Pthread_rwlock_unlock(pthread_rwlock_t* lock);
 
 /* Dynamic library */
-void handle_dynamic_exec_lib(int client_fd, char* resource_name);
-void* load_dyn_library(char* library_name);
-void init_cache();
+int handle_dynamic_exec_lib(int client_fd, char* resource_name,
+                            int* cache_ttl_ms);
+void capture_dynamic_response(int output_fd, request_item* item);
+int send_dynamic_response(int output_fd, request_item* item);
+void* load_dyn_library(char* library_name, int mode);
+void init_cache(int policy);
+void preload_modules();
 #endif
@@ -0,0 +1,455 @@
+/* Work stealing worker pool.
+ * *************************
+ * Every worker has a queue of its own and is pinned to a core, unless the
+ * pool is created unpinned. A request
+ * goes to the less loaded of two workers, by queued jobs plus the one it
+ * runs, so a worker stuck in a long module is mostly passed over. What
+ * still ends up behind it is stolen: a worker which runs out of jobs sweeps
+ * the other queues before it waits.
+ *
+ * An idle worker polls for a while before parking on its futex. The length
+ * of the poll adapts: it doubles when polling found a job, and halves when
+ * the worker had to park anyway. Producers only issue the wake up system
+ * call when the worker they picked, or any when that one is busy, parked.
+ * A worker which takes a job and leaves others in its queue wakes a parked
+ * worker to steal them.
+ *
+ * The pool is elastic. A sizing thread adds a worker, up to the ceiling,
+ * while the average wait of the jobs taken is over WORKER_GROW_WAIT_MS, or
+ * while jobs are queued and none got taken since the last check, which is
+ * what modules blocking every worker look like. A worker above the floor
+ * which stays parked for WORKER_IDLE_COOLDOWN_MS retires.
+ *
+ * Kept apart from the rest of the server as setting the affinity needs
+ * glibc's GNU extensions, and _GNU_SOURCE clashes with csapp.h.
+ */
+#define _GNU_SOURCE
+#include "worker_pool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()     __builtin_ia32_pause()
+#else
+#define cpu_relax()     __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* @return 0 when woken up, -1 with errno ETIMEDOUT after 'timeout_ms' */
+static int futex_wait_timeout(atomic_uint* addr, unsigned int val,
+                              int timeout_ms)
+{
+    struct timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &timeout, NULL,
+                   0);
+}
+
+static void futex_wake(atomic_uint* addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+int worker_pool_cpu_count()
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        return CPU_COUNT(&set);
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+}
+
+/* @return the n-th core the process may run on, -1 if unknown */
+static int nth_allowed_cpu(int n)
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0 || CPU_COUNT(&set) == 0)
+        return -1;
+    n %= CPU_COUNT(&set);
+    int cpu;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &set) && n-- == 0)
+            return cpu;
+    }
+    return -1;
+}
+
+static void wake_worker(worker_t* worker)
+{
+    atomic_fetch_add(&worker->futex_word, 1);
+    futex_wake(&worker->futex_word, 1);
+}
+
+/* Wakes a parked worker, if there is one, to steal a job */
+static void wake_thief(worker_pool_t* pool, worker_t* except)
+{
+    if (atomic_load(&pool->sleepers) == 0)
+        return;
+    int active = atomic_load(&pool->active);
+    int i;
+    for (i = 0; i < active; i++)
+    {
+        worker_t* worker = &pool->workers[i];
+        if (worker != except && atomic_load(&worker->parked))
+        {
+            wake_worker(worker);
+            return;
+        }
+    }
+}
+
+/* Starts the worker of a stopped slot, pinned to the slot's core */
+static void start_worker(worker_pool_t* pool, worker_t* worker)
+{
+    pthread_t thread_id;
+    pthread_attr_t attr;
+    worker->spin_limit = WORKER_SPIN_MIN;
+    atomic_store(&worker->state, WORKER_RUNNING);
+    pthread_attr_init(&attr);
+    if (worker->cpu != -1)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    if (pthread_create(&thread_id, &attr, pool->func, worker) != 0)
+    {
+        perror("Worker thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/* Adds a worker in the slot behind the last running one, unless the pool
+ * is at its ceiling or that slot's worker is still on its way out */
+static void grow_pool(worker_pool_t* pool)
+{
+    int active = atomic_load(&pool->active);
+    if (active >= pool->max_workers)
+        return;
+    worker_t* worker = &pool->workers[active];
+    if (atomic_load(&worker->state) != WORKER_STOPPED)
+        return;
+    /* Races with the last worker retiring */
+    if (!atomic_compare_exchange_strong(&pool->active, &active, active + 1))
+        return;
+    if (atomic_load(&pool->started) < active + 1)
+        atomic_store(&pool->started, active + 1);
+    atomic_fetch_add_explicit(&pool->grown, 1, memory_order_relaxed);
+    start_worker(pool, worker);
+}
+
+static long executed_jobs(worker_pool_t* pool)
+{
+    int started = atomic_load(&pool->started);
+    long executed = 0;
+    int i;
+    for (i = 0; i < started; i++)
+        executed += atomic_load_explicit(&pool->workers[i].executed,
+                                         memory_order_relaxed);
+    return executed;
+}
+
+/* Grows the pool while jobs wait too long for a worker */
+static void* sizing_thread(void* arg)
+{
+    worker_pool_t* pool = (worker_pool_t*)arg;
+    long last_executed = 0;
+    pthread_detach(pthread_self());
+    while (1)
+    {
+        usleep(WORKER_SIZING_INTERVAL_MS * 1000);
+        long executed = executed_jobs(pool);
+        if (worker_pool_length(pool) > 0 &&
+            (atomic_load_explicit(&pool->wait_us, memory_order_relaxed) >
+             WORKER_GROW_WAIT_MS * 1000L || executed == last_executed))
+            grow_pool(pool);
+        last_executed = executed;
+    }
+    return NULL;
+}
+
+/* worker_pool_create
+ * Sets up 'max_workers' slots, the i-th pinned to the ('first_cpu' + i)-th
+ * core the process may run on, or to none if 'first_cpu' is negative, and
+ * starts the first 'min_workers'. With more workers than cores, cores are
+ * shared round robin.
+ * @return new pool's address.
+ */
+worker_pool_t* worker_pool_create(int min_workers, int max_workers,
+                                  int first_cpu, void* (*func)(void*))
+{
+    worker_pool_t* pool = aligned_alloc(CACHE_LINE_SIZE,
+                                        sizeof(worker_pool_t));
+    worker_t* workers = aligned_alloc(CACHE_LINE_SIZE,
+                                      max_workers * sizeof(worker_t));
+    if (pool == NULL || workers == NULL)
+    {
+        perror("Cannot allocate the worker pool");
+        exit(EXIT_FAILURE);
+    }
+    memset(workers, 0, max_workers * sizeof(worker_t));
+    pool->workers = workers;
+    pool->min_workers = min_workers;
+    pool->max_workers = max_workers;
+    pool->func = func;
+    atomic_init(&pool->active, min_workers);
+    atomic_init(&pool->started, min_workers);
+    atomic_init(&pool->next, 0);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->sleepers, 0);
+    atomic_init(&pool->wait_us, 0);
+    atomic_init(&pool->grown, 0);
+    atomic_init(&pool->retired, 0);
+    int i;
+    for (i = 0; i < max_workers; i++)
+    {
+        worker_t* worker = &workers[i];
+        worker->pool = pool;
+        worker->id = i;
+        worker->cpu = first_cpu < 0 ? -1 : nth_allowed_cpu(first_cpu + i);
+        worker->queue = job_queue_create(WORKER_QUEUE_CAPACITY);
+        worker->seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        atomic_init(&worker->state, WORKER_STOPPED);
+    }
+
+    /* Started once all of the queues exist, as workers steal right away */
+    for (i = 0; i < min_workers; i++)
+        start_worker(pool, &workers[i]);
+    if (max_workers > min_workers)
+    {
+        pthread_t thread_id;
+        if (pthread_create(&thread_id, NULL, sizing_thread, pool) != 0)
+        {
+            perror("Worker pool sizing thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return pool;
+}
+
+/* Queued jobs plus the one running */
+static size_t worker_load(worker_t* worker)
+{
+    return job_queue_length(worker->queue) +
+           atomic_load_explicit(&worker->busy, memory_order_relaxed);
+}
+
+int worker_pool_submit(worker_pool_t* pool, void* job)
+{
+    int count = atomic_load_explicit(&pool->active, memory_order_relaxed);
+    unsigned ticket = atomic_fetch_add_explicit(&pool->next, 1,
+                                                memory_order_relaxed);
+    worker_t* first = &pool->workers[ticket % count];
+    worker_t* second = &pool->workers[(ticket * 2654435761u >> 16) % count];
+    worker_t* worker = worker_load(second) < worker_load(first) ?
+                       second : first;
+    /* Counted before the push, so a worker taking the job right away
+     * doesn't take the count below zero */
+    atomic_fetch_add_explicit(&pool->queued, 1, memory_order_relaxed);
+    if (job_queue_push(worker->queue, job) == JOB_QUEUE_FULL)
+    {
+        /* Try the others before giving up */
+        int i;
+        for (i = 1; i <= count; i++)
+        {
+            worker = &pool->workers[(ticket + i) % count];
+            if (job_queue_push(worker->queue, job) == JOB_QUEUE_SUCCESS)
+                break;
+        }
+        if (i > count)
+        {
+            atomic_fetch_sub_explicit(&pool->queued, 1, memory_order_relaxed);
+            return JOB_QUEUE_FULL;
+        }
+    }
+    /* The fence orders the push before these loads, as the worker's one
+     * orders its announcement that it parks before it looks at the queues
+     * a last time. So either it sees the job or we see it parked */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&worker->parked))
+        wake_worker(worker);
+    else if (atomic_load(&worker->busy) ||
+             atomic_load(&worker->state) == WORKER_STOPPED)
+        wake_thief(pool, worker);
+    return JOB_QUEUE_SUCCESS;
+}
+
+/* Sweeps the other workers' queues, starting at a random one */
+static void* steal(worker_t* worker)
+{
+    worker_pool_t* pool = worker->pool;
+    int count = atomic_load_explicit(&pool->started, memory_order_relaxed);
+    worker->seed ^= worker->seed << 13;
+    worker->seed ^= worker->seed >> 7;
+    worker->seed ^= worker->seed << 17;
+    int start = worker->seed % count;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        worker_t* victim = &pool->workers[(start + i) % count];
+        if (victim == worker)
+            continue;
+        void* job = job_queue_pop(victim->queue);
+        if (job != NULL)
+        {
+            atomic_fetch_add_explicit(&worker->stolen, 1,
+                                      memory_order_relaxed);
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static void* find_job(worker_t* worker)
+{
+    void* job = job_queue_pop(worker->queue);
+    if (job == NULL)
+        job = steal(worker);
+    return job;
+}
+
+/* Polls the own queue, and every WORKER_STEAL_INTERVAL polls the others,
+ * for up to 'spin_limit' polls */
+static void* spin_for_job(worker_t* worker)
+{
+    unsigned i;
+    for (i = 1; i <= worker->spin_limit; i++)
+    {
+        cpu_relax();
+        void* job = i % WORKER_STEAL_INTERVAL == 0 ? find_job(worker) :
+                                               job_queue_pop(worker->queue);
+        if (job != NULL)
+        {
+            if (worker->spin_limit < WORKER_SPIN_MAX)
+                worker->spin_limit *= 2;
+            return job;
+        }
+    }
+    if (worker->spin_limit > WORKER_SPIN_MIN)
+        worker->spin_limit /= 2;
+    return NULL;
+}
+
+/* A worker above the floor leaves, the last one first, so that the running
+ * workers stay the first slots.
+ * @return 1 if the worker retired */
+static int try_retire(worker_t* worker)
+{
+    worker_pool_t* pool = worker->pool;
+    int active = atomic_load(&pool->active);
+    if (worker->id != active - 1 || active <= pool->min_workers)
+        return 0;
+    if (!atomic_compare_exchange_strong(&pool->active, &active, active - 1))
+        return 0;
+    atomic_store(&worker->state, WORKER_STOPPED);
+    atomic_fetch_add_explicit(&pool->retired, 1, memory_order_relaxed);
+    /* A submitter which picked this slot before it went away sees it
+     * stopped and wakes a thief. Jobs which got here earlier are handed on
+     * the same way */
+    if (job_queue_length(worker->queue) > 0)
+        wake_thief(pool, worker);
+    return 1;
+}
+
+/* @return job, or NULL if the worker retired */
+static void* park_for_job(worker_t* worker)
+{
+    worker_pool_t* pool = worker->pool;
+    while (1)
+    {
+        unsigned seen = atomic_load(&worker->futex_word);
+        atomic_store(&worker->parked, 1);
+        atomic_fetch_add(&pool->sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        /* Look again after announcing ourselves. A job pushed before the
+         * announcement is found here, a later push wakes us up */
+        void* job = find_job(worker);
+        int idle = 0;
+        if (job == NULL)
+        {
+            atomic_fetch_add_explicit(&worker->parks, 1, memory_order_relaxed);
+            idle = futex_wait_timeout(&worker->futex_word, seen,
+                                      WORKER_IDLE_COOLDOWN_MS) == -1 &&
+                   errno == ETIMEDOUT;
+            job = find_job(worker);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        atomic_store(&worker->parked, 0);
+        if (job != NULL)
+            return job;
+        if (idle && try_retire(worker))
+            return NULL;
+    }
+}
+
+void* worker_pool_take(worker_t* worker)
+{
+    atomic_store_explicit(&worker->busy, 0, memory_order_relaxed);
+    void* job = find_job(worker);
+    if (job == NULL)
+        job = spin_for_job(worker);
+    if (job == NULL)
+        job = park_for_job(worker);
+    if (job == NULL)
+        return NULL;
+    atomic_store(&worker->busy, 1);
+    atomic_fetch_sub_explicit(&worker->pool->queued, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&worker->executed, 1, memory_order_relaxed);
+    /* Don't let the rest of our queue wait for this job */
+    if (job_queue_length(worker->queue) > 0)
+        wake_thief(worker->pool, worker);
+    return job;
+}
+
+/* Updates the average without a lock. Concurrent updates may lose one of
+ * the samples, which doesn't matter for an average */
+void worker_pool_record_wait(worker_pool_t* pool, uint64_t wait_ms)
+{
+    long average = atomic_load_explicit(&pool->wait_us, memory_order_relaxed);
+    average += ((long)wait_ms * 1000 - average) >> WORKER_WAIT_EWMA_SHIFT;
+    atomic_store_explicit(&pool->wait_us, average, memory_order_relaxed);
+}
+
+size_t worker_pool_length(worker_pool_t* pool)
+{
+    long queued = atomic_load_explicit(&pool->queued, memory_order_relaxed);
+    return queued > 0 ? (size_t)queued : 0;
+}
+
+void get_worker_pool_stats(worker_pool_t* pool, worker_pool_stats_t* stats)
+{
+    int started = atomic_load_explicit(&pool->started, memory_order_relaxed);
+    memset(stats, 0, sizeof(worker_pool_stats_t));
+    stats->workers = atomic_load_explicit(&pool->active, memory_order_relaxed);
+    stats->min_workers = pool->min_workers;
+    stats->max_workers = pool->max_workers;
+    stats->wait_us = atomic_load_explicit(&pool->wait_us,
+                                          memory_order_relaxed);
+    stats->grown = atomic_load_explicit(&pool->grown, memory_order_relaxed);
+    stats->retired = atomic_load_explicit(&pool->retired,
+                                          memory_order_relaxed);
+    int i;
+    for (i = 0; i < started; i++)
+    {
+        worker_t* worker = &pool->workers[i];
+        stats->busy += atomic_load_explicit(&worker->busy,
+                                            memory_order_relaxed);
+        stats->executed += atomic_load_explicit(&worker->executed,
+                                                memory_order_relaxed);
+        stats->stolen += atomic_load_explicit(&worker->stolen,
+                                              memory_order_relaxed);
+        stats->parks += atomic_load_explicit(&worker->parks,
+                                             memory_order_relaxed);
+    }
+}
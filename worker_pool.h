@@ -0,0 +1,105 @@
+/*
+ * Header file for the pool of worker threads serving dynamic requests.
+ * Every worker is pinned to a core and has a queue of its own. Idle workers
+ * steal from the queues of busy ones. The pool grows while requests wait
+ * too long for a worker and shrinks again when workers sit idle.
+ */
+#ifndef __WORKER_POOL_H
+#define __WORKER_POOL_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "job_queue.h"
+
+#define WORKER_QUEUE_CAPACITY   4096 /* Jobs waiting on a single worker */
+#define WORKER_SPIN_MIN         64 /* Polls of an idle worker before it */
+#define WORKER_SPIN_MAX         (1 << 14) /* parks. Adapts in between */
+#define WORKER_STEAL_INTERVAL   16 /* Polls of its own queue between two
+                                      sweeps over the others' */
+#define WORKER_GROW_WAIT_MS     10 /* Average wait for a worker past which
+                                      the pool grows */
+#define WORKER_IDLE_COOLDOWN_MS 2000 /* Idle time after which a worker
+                                        above the floor retires */
+#define WORKER_SIZING_INTERVAL_MS 20 /* Pool grows by a worker at most
+                                        this often */
+#define WORKER_WAIT_EWMA_SHIFT  3 /* A new wait weighs 1/8 in the average */
+
+#define WORKER_STOPPED          0
+#define WORKER_RUNNING          1
+
+struct worker_pool;
+
+typedef struct worker
+{
+    struct worker_pool* pool;
+    int id; /* Slot in the pool */
+    int cpu; /* Core it is pinned to, -1 if it isn't */
+    job_queue_t* queue; /* Jobs handed to this worker */
+    uint64_t seed; /* Picks the first victim of a steal */
+    unsigned spin_limit; /* Polls before parking. Grows when polling pays
+                            off, shrinks when the worker parks anyway */
+    _Alignas(CACHE_LINE_SIZE) atomic_uint futex_word; /* Bumped to wake the
+                                                         worker up */
+    atomic_int parked;
+    atomic_int busy; /* Running a job */
+    atomic_int state; /* WORKER_STOPPED or WORKER_RUNNING */
+    _Alignas(CACHE_LINE_SIZE) atomic_long executed;
+    atomic_long stolen;
+    atomic_long parks;
+}worker_t;
+
+/* The running workers always are the first 'active' slots. Only the last
+ * of them retires, and a new one takes the slot right behind */
+typedef struct worker_pool
+{
+    worker_t* workers; /* 'max_workers' slots */
+    int min_workers;
+    int max_workers;
+    void* (*func)(void*); /* Thread function of the workers */
+    _Alignas(CACHE_LINE_SIZE) atomic_int active; /* Workers taking jobs */
+    atomic_int started; /* Slots which ever had a worker. Stealing sweeps
+                           them all, a job may be left in a retired one */
+    _Alignas(CACHE_LINE_SIZE) atomic_uint next; /* Spreads submissions */
+    atomic_long queued; /* Jobs submitted and not yet taken. Next to 'next',
+                           so a submission writes a single shared line */
+    _Alignas(CACHE_LINE_SIZE) atomic_int sleepers; /* Workers parked */
+    _Alignas(CACHE_LINE_SIZE) atomic_long wait_us; /* Average time a job
+                                                      waited for a worker */
+    atomic_long grown;
+    atomic_long retired;
+}worker_pool_t;
+
+/* Pool statistics, summed over the workers */
+typedef struct worker_pool_stats
+{
+    int workers;
+    int min_workers;
+    int max_workers;
+    int busy;
+    long wait_us;
+    long executed;
+    long stolen;
+    long parks;
+    long grown;
+    long retired;
+}worker_pool_stats_t;
+
+/* Number of cores the server may run on */
+int worker_pool_cpu_count();
+/* Starts 'min_workers' workers running 'func', which gets its worker_t*.
+ * The pool grows up to 'max_workers'. Its workers are pinned to the cores
+ * from the 'first_cpu'-th on, or left to the scheduler if it is negative */
+worker_pool_t* worker_pool_create(int min_workers, int max_workers,
+                                  int first_cpu, void* (*func)(void*));
+/* Hands a job to the least loaded of two workers. Never blocks.
+ * @return JOB_QUEUE_SUCCESS or JOB_QUEUE_FULL */
+int worker_pool_submit(worker_pool_t* pool, void* job);
+/* Called by a worker. Blocks until there is a job for it. NULL means the
+ * worker retired and its thread has to exit */
+void* worker_pool_take(worker_t* worker);
+/* Called by a worker with how long the job it took waited */
+void worker_pool_record_wait(worker_pool_t* pool, uint64_t wait_ms);
+/* Jobs waiting in all of the queues. Reads a single counter */
+size_t worker_pool_length(worker_pool_t* pool);
+void get_worker_pool_stats(worker_pool_t* pool, worker_pool_stats_t* stats);
+#endif /* __WORKER_POOL_H */